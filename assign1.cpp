@@ -6,12 +6,392 @@
 #include <algorithm>
 #include <sstream>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <unordered_map>
+#include <future>
+#include <cctype>
+#include <cmath>
+#include <random>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+#include <type_traits>
+#include <functional>
 
 using namespace std;
 
-time_t getCurrentDate() 
+// Allocations made by the current thread, counted by the replacement operator new and
+// delete below. Plain per-thread counters keep the hooks about as cheap as malloc itself
+struct HeapCounters
 {
-    return time(nullptr) / (60 * 60 * 24); // Convert seconds to days
+    unsigned long long allocations;
+    unsigned long long frees;
+};
+
+thread_local HeapCounters heapCounters;
+
+// Bytes handed out by malloc and not yet freed, over all threads; large blocks are
+// mmapped and counted separately from the arena. Older glibc only has mallinfo, whose
+// int fields wrap past 2 GB, and other C libraries report nothing
+size_t heapBytesInUse()
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    struct mallinfo info = mallinfo();
+    return (unsigned int)info.uordblks + (unsigned int)info.hblkhd;
+#endif
+#else
+    return 0;
+#endif
+}
+
+void* operator new(size_t size)
+{
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    heapCounters.allocations++;
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (!p)
+        return;
+    heapCounters.frees++;
+    free(p);
+}
+
+// Sized and array forms, so every allocation goes through the counted pair above
+void operator delete(void* p, size_t) noexcept
+{
+    ::operator delete(p);
+}
+
+void* operator new[](size_t size)
+{
+    return ::operator new(size);
+}
+
+void operator delete[](void* p) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    ::operator delete(p);
+}
+
+// Heap owned by one data structure, found by walking it: bytes and separate allocations.
+// Container sizes follow the libstdc++ layouts, so the numbers are close but not exact
+struct MemoryUsage
+{
+    size_t bytes;
+    size_t blocks;
+
+    MemoryUsage() : bytes(0), blocks(0) {}
+
+    void addBlocks(size_t count, size_t size) {
+        if (count == 0 || size == 0)
+            return;
+        bytes += count * size;
+        blocks += count;
+    }
+
+    void add(const MemoryUsage& other) {
+        bytes += other.bytes;
+        blocks += other.blocks;
+    }
+
+    // Short strings are stored inside the string object and cost nothing extra
+    void addString(const string& str) {
+        const char* self = reinterpret_cast<const char*>(&str);
+        if (str.data() < self || str.data() >= self + sizeof(string))
+            addBlocks(1, str.capacity() + 1);
+    }
+
+    template <typename T>
+    void addVector(const vector<T>& vec) { addBlocks(1, vec.capacity() * sizeof(T)); }
+
+    // Object made by make_shared: one block holding the counts and the object
+    void addShared(size_t objectSize) { addBlocks(1, objectSize + 2 * sizeof(void*)); }
+
+    // Bucket array plus one node per element: next pointer, value and (for string keys) the cached hash
+    template <typename K, typename V, typename H>
+    void addHashMap(const unordered_map<K, V, H>& map) {
+        if (map.bucket_count() > 1)
+            addBlocks(1, map.bucket_count() * sizeof(void*));
+        size_t cachedHash = is_same<K, string>::value ? sizeof(size_t) : 0;
+        addBlocks(map.size(), sizeof(void*) + sizeof(pair<const K, V>) + cachedHash);
+    }
+
+    // Red-black tree nodes: colour, three links and the value
+    template <typename K, typename V>
+    void addTree(const multimap<K, V>& tree) {
+        addBlocks(tree.size(), 4 * sizeof(void*) + sizeof(pair<const K, V>));
+    }
+};
+
+// Memory per structure over every branch, with projections for a larger library
+struct MemoryReport
+{
+    size_t bookCount;
+    size_t accountCount;
+    MemoryUsage books;          // the book records, their strings and the vector pointing at them
+    MemoryUsage bookIndexes;    // id, title, author, publisher and year lookups
+    MemoryUsage titleIndex;     // trigram index for approximate title search
+    MemoryUsage completer;      // title autocomplete trie
+    MemoryUsage accounts;       // vector<Account>
+    MemoryUsage users;          // shared_ptr<User> objects and their strings
+    MemoryUsage loans;          // each borrower's (title, day) loan vector
+    MemoryUsage accountFilter;  // Bloom filter and exact lookup by name and id
+    MemoryUsage snapshots;      // last published view of each branch, if still held, less what it shares
+
+    MemoryReport() : bookCount(0), accountCount(0) {}
+
+    MemoryUsage catalogTotal() const {
+        MemoryUsage total = books;
+        total.add(bookIndexes);
+        total.add(titleIndex);
+        total.add(completer);
+        return total;
+    }
+
+    MemoryUsage accountTotal() const {
+        MemoryUsage total = accounts;
+        total.add(users);
+        total.add(loans);
+        total.add(accountFilter);
+        return total;
+    }
+
+    static void printLine(ostream& os, const char* name, const MemoryUsage& usage) {
+        os << "  " << name << ": " << usage.bytes << " bytes in " << usage.blocks << " allocations\n";
+    }
+
+    void print(ostream& os) const {
+        const double mb = 1024.0 * 1024.0;
+        os << "Memory by structure (" << bookCount << " books, " << accountCount << " accounts):\n";
+        printLine(os, "Books", books);
+        printLine(os, "Book indexes", bookIndexes);
+        printLine(os, "Title search index", titleIndex);
+        printLine(os, "Title autocomplete", completer);
+        printLine(os, "Accounts", accounts);
+        printLine(os, "User objects", users);
+        printLine(os, "Loan lists", loans);
+        printLine(os, "Account filter", accountFilter);
+        printLine(os, "Published snapshots", snapshots);
+
+        MemoryUsage catalog = catalogTotal(), people = accountTotal(), all = catalog;
+        all.add(people);
+        all.add(snapshots);
+        printLine(os, "Attributed total", all);
+        os << "  Heap in use: " << heapBytesInUse() << " bytes; this thread has made "
+           << heapCounters.allocations << " allocations and " << heapCounters.frees << " frees\n";
+        if (bookCount > 0)
+            os << "  Projected catalog: " << catalog.bytes * 1e6 / bookCount / mb << " MB per 1M books\n";
+        if (accountCount > 0)
+            os << "  Projected accounts: " << people.bytes * 1e5 / accountCount / mb << " MB per 100k accounts\n";
+    }
+};
+
+// Source of the current day; replaced by a simulated clock during workload replays
+class Clock
+{
+public:
+    virtual time_t today() const = 0;
+    virtual ~Clock() {}
+};
+
+class SystemClock : public Clock
+{
+public:
+    time_t today() const override {
+        return time(nullptr) / (60 * 60 * 24); // Convert seconds to days
+    }
+};
+
+class SimulatedClock : public Clock
+{
+private:
+    time_t day;
+
+public:
+    explicit SimulatedClock(time_t startDay) : day(startDay) {}
+
+    time_t today() const override { return day; }
+    void setDay(time_t newDay) { day = newDay; }
+    void advance(int days) { day += days; }
+};
+
+Clock& systemClock()
+{
+    static SystemClock clock;
+    return clock;
+}
+
+Clock*& activeClock()
+{
+    static Clock* current = &systemClock();
+    return current;
+}
+
+// Passing nullptr goes back to the system clock
+void setClock(Clock* clock)
+{
+    activeClock() = clock ? clock : &systemClock();
+}
+
+time_t getCurrentDate()
+{
+    return activeClock()->today();
+}
+
+// Destination of all user-facing output; replaced during workload replays
+class OutputSink
+{
+public:
+    virtual void write(const char* data, size_t n) = 0;
+    virtual void flush() = 0;
+    virtual ~OutputSink() {}
+};
+
+// Buffered writer on a file descriptor. Text collects in memory and goes out in one
+// write() when the buffer fills or at a flush (every prompt), not once per line
+class FdSink : public OutputSink
+{
+private:
+    int fd;
+    vector<char> buffer;
+    size_t used;
+    long long writeCalls;
+
+    void writeAll(const char* data, size_t n) {
+        while (n > 0) {
+            ssize_t written = ::write(fd, data, n);
+            writeCalls++;
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            data += written;
+            n -= written;
+        }
+    }
+
+public:
+    explicit FdSink(int fileDescriptor, size_t capacity = 64 * 1024)
+        : fd(fileDescriptor), buffer(capacity), used(0), writeCalls(0) {}
+
+    ~FdSink() { flush(); }
+
+    void write(const char* data, size_t n) override {
+        if (used + n > buffer.size())
+            flush();
+        if (n >= buffer.size()) {
+            writeAll(data, n);
+            return;
+        }
+        memcpy(&buffer[used], data, n);
+        used += n;
+    }
+
+    void flush() override {
+        writeAll(buffer.data(), used);
+        used = 0;
+    }
+
+    int getFd() const { return fd; }
+    long long getWriteCalls() const { return writeCalls; }
+};
+
+// Collects output in memory, for callers that deliver it themselves
+class StringSink : public OutputSink
+{
+private:
+    string text;
+
+public:
+    void write(const char* data, size_t n) override { text.append(data, n); }
+    void flush() override {}
+
+    // Everything written since the last call
+    string take() {
+        string taken;
+        taken.swap(text);
+        return taken;
+    }
+};
+
+FdSink& stdoutSink()
+{
+    static FdSink sink(STDOUT_FILENO);
+    return sink;
+}
+
+OutputSink*& activeSink()
+{
+    static OutputSink* current = &stdoutSink();
+    return current;
+}
+
+// Passing nullptr goes back to standard output
+void setOutput(OutputSink* sink)
+{
+    activeSink()->flush();
+    activeSink() = sink ? sink : &stdoutSink();
+}
+
+// Hands everything written through out() to the active sink
+class SinkStreamBuf : public streambuf
+{
+protected:
+    int overflow(int c) override {
+        if (c != EOF) {
+            char ch = (char)c;
+            activeSink()->write(&ch, 1);
+        }
+        return c;
+    }
+
+    streamsize xsputn(const char* s, streamsize n) override {
+        activeSink()->write(s, (size_t)n);
+        return n;
+    }
+
+    int sync() override {
+        activeSink()->flush();
+        return 0;
+    }
+};
+
+// Stream for user-facing output. Lines end with '\n' rather than endl; main ties cin and
+// cerr to this stream so it is flushed before every prompt is read and before any error
+ostream& out()
+{
+    static SinkStreamBuf buf;
+    static ostream stream(&buf);
+    return stream;
 }
 
 // Base User class
@@ -23,164 +403,268 @@ protected:
     string jobType;         
 
 public:
-    User(string nm, int idd, string type) : buddyName(nm), buddyID(idd), jobType(type) {}
+    User(string nm, int idd, string type) : buddyName(move(nm)), buddyID(idd), jobType(move(type)) {}
 
-    string getName() const { return buddyName; }
+    const string& getName() const { return buddyName; }
     int getId() const { return buddyID; }
-    string getRole() const { return jobType; }
+    const string& getRole() const { return jobType; }
+
+    void addMemoryUsage(MemoryUsage& usage) const {
+        usage.addString(buddyName);
+        usage.addString(jobType);
+    }
 
     virtual void display() const {
-        cout << "Yo! I'm " << buddyName << " (ID: " << buddyID << "), rockin' as a " << jobType << "!" << endl;
+        out() << "Yo! I'm " << buddyName << " (ID: " << buddyID << "), rockin' as a " << jobType << "!\n";
     }
 
+    // Deep copy used for read-only snapshots
+    virtual shared_ptr<User> clone() const = 0;
+
+    // Size of the concrete object, for the memory report
+    virtual size_t objectSize() const = 0;
+
     virtual ~User() {}
 };
 
-// Derived Student class
-class Student : public User 
+// Borrowing rules for each role. Every rule is a constexpr constant so the checks in
+// Borrower<Policy> fold into plain comparisons; a new role is just another policy struct
+struct StudentPolicy
 {
-private:
-    int bookCount;                         
-    vector<pair<string, time_t>> borrowedBooks;    
-    double outstandingFine;                       
+    static constexpr const char* role() { return "Student"; }
+    static constexpr const char* described() { return "a student"; }
+    static constexpr char code() { return 'S'; }          // role byte in accounts.dat
+    static constexpr int maxLoans() { return 3; }
+    static constexpr int loanDays() { return 15; }
+    static constexpr int finePerDay() { return 10; }      // rupees per late day, 0 for none
+    static constexpr int blockAfterDays() { return 0; }   // days past due that block borrowing, 0 for never
+    static constexpr bool detailedMessages() { return true; }   // loan totals in messages, overdue marks on display
+};
+
+struct FacultyPolicy
+{
+    static constexpr const char* role() { return "Faculty"; }
+    static constexpr const char* described() { return "a faculty member"; }
+    static constexpr char code() { return 'F'; }
+    static constexpr int maxLoans() { return 5; }
+    static constexpr int loanDays() { return 30; }
+    static constexpr int finePerDay() { return 0; }
+    static constexpr int blockAfterDays() { return 60; }
+    static constexpr bool detailedMessages() { return false; }
+};
+
+// Loans and fines shared by every borrowing role. Only the rule checks are virtual,
+// so Account reaches any role through this one type
+class BorrowerBase : public User
+{
+protected:
+    vector<pair<string, time_t>> borrowedBooks;
+    double outstandingFine;
+    char roleCode;
+    bool finesApply;
+    int loanPeriod;
+
+    BorrowerBase(string nm, int idd, string type, char code, bool fines, int loanDays)
+        : User(move(nm), idd, move(type)), outstandingFine(0), roleCode(code), finesApply(fines), loanPeriod(loanDays) {}
+
+    vector<pair<string, time_t>>::iterator findLoan(const string& bookTitle) {
+        return find_if(borrowedBooks.begin(), borrowedBooks.end(), [&](const pair<string, time_t>& pair) {
+            return pair.first == bookTitle;
+        });
+    }
 
 public:
-    Student(string nm, int idd) : User(nm, idd, "Student"), bookCount(0), outstandingFine(0) {}
-    
     const vector<pair<string, time_t>>& getCurrentBooks() const { return borrowedBooks; }
-    
+    char getRoleCode() const { return roleCode; }
+    bool chargesFines() const { return finesApply; }
+    int getLoanDays() const { return loanPeriod; }
+
+    void addLoanUsage(MemoryUsage& usage) const {
+        usage.addVector(borrowedBooks);
+        for (const auto& loan : borrowedBooks)
+            usage.addString(loan.first);
+    }
+
+    virtual double computeFine(time_t now) const = 0;
+    virtual bool borrowBook(const string& bookTitle, time_t bDay) = 0;
+    virtual bool returnBook(const string& bookTitle, time_t retDay) = 0;
+
     void updateFines(time_t now) {
-        double totalFine = 0;
-        for (const auto& book : borrowedBooks) {
-            time_t bday = book.second;
-            int lateDays = now - bday - 15;
-            if (lateDays > 0)
-                totalFine += lateDays * 10;
-        }
-        outstandingFine = totalFine;
+        if (finesApply)
+            outstandingFine = computeFine(now);
     }
-    
-    bool borrowBook(const string& bookTitle, time_t bDay) {
-        updateFines(bDay);
-        if (bookCount >= 3) {
-            cout << "You've reached the borrowing limit. Please return a book first." << endl;
-            return false;
-        }
-        if (outstandingFine > 0) {
-            cout << "You have an outstanding fine of " << outstandingFine << " rupees. Please pay it before borrowing more books." << endl;
-            return false;
-        }
+
+    // Re-adding a loan read from disk; no limits or fines are checked
+    void restoreLoan(const string& bookTitle, time_t bDay) {
         borrowedBooks.push_back({bookTitle, bDay});
-        bookCount++;
-        cout << "Book '" << bookTitle << "' borrowed successfully. Total books now: " << bookCount << "." << endl;
-        return true;
     }
-    
-    bool returnBook(const string& bookTitle, time_t retDay) {
-        updateFines(retDay);
-        auto it = find_if(borrowedBooks.begin(), borrowedBooks.end(), [&](const pair<string, time_t>& pair) {
-            return pair.first == bookTitle;
-        });
-        if (it != borrowedBooks.end()) {
+
+    void dropLoan(const string& bookTitle) {
+        auto it = findLoan(bookTitle);
+        if (it != borrowedBooks.end())
             borrowedBooks.erase(it);
-            bookCount--;
-            cout << "Book '" << bookTitle << "' returned. Total books now: " << bookCount << "." << endl;
-            return true;
-        }
-        cout << "The book '" << bookTitle << "' is not in your borrowed list." << endl;
-        return false;
     }
-    
+
     double getFine() const { return outstandingFine; }
     void setFine(double newFine) { outstandingFine = newFine; }
-    
+
     void payFine() {
         if (outstandingFine > 0) {
-            cout << "You paid " << outstandingFine << " rupees. Thank you." << endl;
+            out() << "You paid " << outstandingFine << " rupees. Thank you.\n";
             outstandingFine = 0;
         } else {
-            cout << "You don't have any outstanding fines." << endl;
-        }
-    }
-    
-    void display() const override {
-        const_cast<Student*>(this)->updateFines(getCurrentDate());
-        User::display();
-        cout << "Borrowed Books: ";
-        for (const auto& bk : borrowedBooks) {
-            cout << bk.first << ", ";
-            int late = (int)(getCurrentDate() - bk.second - 15);
-            if (late > 0)
-                cout << "(Overdue by " << late << " days) ";
+            out() << "You don't have any outstanding fines.\n";
         }
-        cout << "\nOutstanding Fine: " << outstandingFine << " rupees" << endl;
     }
 };
 
-
-class Faculty : public User 
+// One borrower implementation for all roles, with the rules taken from Policy
+template <typename Policy>
+class Borrower : public BorrowerBase
 {
-private:
-    int bookCount;   
-    vector<pair<string, time_t>> borrowedBooks;   
-    
 public:
-    Faculty(string nm, int idd) : User(nm, idd, "Faculty"), bookCount(0) {}
-    
-    const vector<pair<string, time_t>>& getCurrentBooks() const { return borrowedBooks; }
-    
+    Borrower(string nm, int idd)
+        : BorrowerBase(move(nm), idd, Policy::role(), Policy::code(), Policy::finePerDay() > 0, Policy::loanDays()) {}
+
+    double computeFine(time_t now) const override {
+        if (Policy::finePerDay() == 0)
+            return 0;
+        double totalFine = 0;
+        for (const auto& book : borrowedBooks) {
+            int lateDays = (int)(now - book.second - Policy::loanDays());
+            if (lateDays > 0)
+                totalFine += lateDays * Policy::finePerDay();
+        }
+        return totalFine;
+    }
+
     bool hasOverdueBooks(time_t now) const {
+        if (Policy::blockAfterDays() == 0)
+            return false;
         for (const auto& bk : borrowedBooks) {
-            int late = now - bk.second - 30;
-            if (late > 60)
+            if (now - bk.second - Policy::loanDays() > Policy::blockAfterDays())
                 return true;
         }
         return false;
     }
-    
-    bool borrowBook(const string& bookTitle, time_t bDay) {
-        if (bookCount >= 5) {
-            cout << "You've reached your borrowing limit. Please return a book first." << endl;
+
+    bool borrowBook(const string& bookTitle, time_t bDay) override {
+        updateFines(bDay);
+        if ((int)borrowedBooks.size() >= Policy::maxLoans()) {
+            if (Policy::detailedMessages())
+                out() << "You've reached the borrowing limit. Please return a book first.\n";
+            else
+                out() << "You've reached your borrowing limit. Please return a book first.\n";
+            return false;
+        }
+        if (Policy::finePerDay() > 0 && outstandingFine > 0) {
+            out() << "You have an outstanding fine of " << outstandingFine << " rupees. Please pay it before borrowing more books.\n";
             return false;
         }
         if (hasOverdueBooks(bDay)) {
-            cout << "You have a book overdue by more than 60 days. Return it before borrowing new ones." << endl;
+            out() << "You have a book overdue by more than " << Policy::blockAfterDays() << " days. Return it before borrowing new ones.\n";
             return false;
         }
         borrowedBooks.push_back({bookTitle, bDay});
-        bookCount++;
-        cout << "Book '" << bookTitle << "' borrowed successfully." << endl;
+        if (Policy::detailedMessages())
+            out() << "Book '" << bookTitle << "' borrowed successfully. Total books now: " << borrowedBooks.size() << ".\n";
+        else
+            out() << "Book '" << bookTitle << "' borrowed successfully.\n";
         return true;
     }
-    
-    bool returnBook(const string& bookTitle, time_t retDay) {
-        auto it = find_if(borrowedBooks.begin(), borrowedBooks.end(), [&](const pair<string, time_t>& pair) {
-            return pair.first == bookTitle;
-        });
-        if (it != borrowedBooks.end()) {
-            int late = retDay - it->second - 30;
-            if (late > 60)
-                cout << "Note: This book is very overdue." << endl;
-            borrowedBooks.erase(it);
-            bookCount--;
-            cout << "Book '" << bookTitle << "' returned successfully." << endl;
-            return true;
+
+    bool returnBook(const string& bookTitle, time_t retDay) override {
+        updateFines(retDay);
+        auto it = findLoan(bookTitle);
+        if (it == borrowedBooks.end()) {
+            if (Policy::detailedMessages())
+                out() << "The book '" << bookTitle << "' is not in your borrowed list.\n";
+            else
+                out() << "Book '" << bookTitle << "' not found in your borrowed list.\n";
+            return false;
         }
-        cout << "Book '" << bookTitle << "' not found in your borrowed list." << endl;
-        return false;
+        if (Policy::blockAfterDays() > 0 && retDay - it->second - Policy::loanDays() > Policy::blockAfterDays())
+            out() << "Note: This book is very overdue.\n";
+        borrowedBooks.erase(it);
+        if (Policy::detailedMessages())
+            out() << "Book '" << bookTitle << "' returned. Total books now: " << borrowedBooks.size() << ".\n";
+        else
+            out() << "Book '" << bookTitle << "' returned successfully.\n";
+        return true;
     }
-    
+
+    shared_ptr<User> clone() const override { return make_shared<Borrower>(*this); }
+    size_t objectSize() const override { return sizeof(*this); }
+
     void display() const override {
+        time_t today = getCurrentDate();
         User::display();
-        cout << "Borrowed Books: ";
+        out() << "Borrowed Books: ";
         for (const auto& bk : borrowedBooks) {
-            cout << bk.first << ", ";
+            out() << bk.first << ", ";
+            int late = (int)(today - bk.second - Policy::loanDays());
+            if (Policy::detailedMessages() && late > 0)
+                out() << "(Overdue by " << late << " days) ";
         }
-        cout << endl;
-        if (hasOverdueBooks(getCurrentDate()))
-            cout << "Please note: You have a book overdue by more than 60 days." << endl;
+        if (Policy::finePerDay() > 0)
+            out() << "\nOutstanding Fine: " << computeFine(today) << " rupees\n";
+        else
+            out() << '\n';
+        if (hasOverdueBooks(today))
+            out() << "Please note: You have a book overdue by more than " << Policy::blockAfterDays() << " days.\n";
     }
 };
+
+typedef Borrower<StudentPolicy> Student;
+typedef Borrower<FacultyPolicy> Faculty;
+
+// Runtime view of a borrowing role, for the account loaders, login and the reports
+struct BorrowerRole
+{
+    const char* name;
+    const char* described;
+    char code;
+    int loanDays;
+    shared_ptr<BorrowerBase> (*create)(const string& name, int id);
+};
+
+template <typename Policy>
+shared_ptr<BorrowerBase> createBorrower(const string& name, int id)
+{
+    return make_shared<Borrower<Policy>>(name, id);
+}
+
+template <typename Policy>
+BorrowerRole describeRole()
+{
+    return {Policy::role(), Policy::described(), Policy::code(), Policy::loanDays(), &createBorrower<Policy>};
+}
+
+// Every borrowing role, in role menu order; a new role gets its entry here
+static const vector<BorrowerRole>& borrowerRoles()
+{
+    static const vector<BorrowerRole> roles = {describeRole<StudentPolicy>(), describeRole<FacultyPolicy>()};
+    return roles;
+}
+
+static const BorrowerRole* findBorrowerRole(const string& name)
+{
+    for (const BorrowerRole& role : borrowerRoles()) {
+        if (name == role.name)
+            return &role;
+    }
+    return nullptr;
+}
+
+static const BorrowerRole* findBorrowerRole(char code)
+{
+    for (const BorrowerRole& role : borrowerRoles()) {
+        if (code == role.code)
+            return &role;
+    }
+    return nullptr;
+}
+
 // Book class
 class Book 
 {
@@ -192,30 +676,46 @@ private:
     string ISBN;
     string status;
     string reservedBy;
+    int id;
 
 public:
     Book(string title, string author, string publisher, int year, string ISBN)
-        : title(title), author(author), publisher(publisher), year(year), ISBN(ISBN), status("Available"), reservedBy("") {}
+        : title(move(title)), author(move(author)), publisher(move(publisher)), year(year), ISBN(move(ISBN)),
+          status("Available"), reservedBy(""), id(0) {}
+
+    // Branch-local key assigned by the Library; stays the same while the book is in the catalog
+    int getId() const { return id; }
+    void setId(int newId) { id = newId; }
 
-    string getTitle() const { return title; }
-    string getAuthor() const { return author; }
-    string getPublisher() const { return publisher; }
+    const string& getTitle() const { return title; }
+    const string& getAuthor() const { return author; }
+    const string& getPublisher() const { return publisher; }
     int getYear() const { return year; }
-    string getISBN() const { return ISBN; }
-    string getStatus() const { return status; }
-    string getReservedBy() const { return reservedBy; }
+    const string& getISBN() const { return ISBN; }
+    const string& getStatus() const { return status; }
+    const string& getReservedBy() const { return reservedBy; }
 
     void setStatus(const string& newStatus) { status = newStatus; }
     void setReservedBy(const string& userName) { reservedBy = userName; }
 
+    // Strings held outside the Book itself
+    void addMemoryUsage(MemoryUsage& usage) const {
+        usage.addString(title);
+        usage.addString(author);
+        usage.addString(publisher);
+        usage.addString(ISBN);
+        usage.addString(status);
+        usage.addString(reservedBy);
+    }
+
     void display() const {
-        cout << "Title: " << title << ", Author: " << author << ", Publisher: " << publisher
+        out() << "Title: " << title << ", Author: " << author << ", Publisher: " << publisher
              << ", Year: " << year << ", ISBN: " << ISBN << ", Status: " << status;
         if (status == "Reserved") 
         {
-            cout << ", Reserved By: " << reservedBy;
+            out() << ", Reserved By: " << reservedBy;
         }
-        cout << endl;
+        out() << '\n';
     }
 };
 
@@ -223,812 +723,3854 @@ public:
 class Librarian : public User 
 {
 public:
-    Librarian(string nm, int idd) : User(nm, idd, "Librarian") {}
+    Librarian(string nm, int idd) : User(move(nm), idd, "Librarian") {}
+
+    shared_ptr<User> clone() const override { return make_shared<Librarian>(*this); }
+    size_t objectSize() const override { return sizeof(*this); }
+};
+
+
+class Account 
+{
+private:
+    shared_ptr<User> user;      // shared with snapshots until this account next changes
+    double fineAmount;          
     
-    void addBook(vector<Book>& books, const Book& book) {
-        books.push_back(book);
-        cout << "Boom! Added the book: " << book.getTitle() << " to the gig." << endl;
+    // The user, copied first if a snapshot still holds it; null for roles that do not borrow
+    BorrowerBase* editBorrower() {
+        if (!getBorrower())
+            return nullptr;
+        if (user.use_count() > 1)
+            user = user->clone();
+        return static_cast<BorrowerBase*>(user.get());
     }
+
+public:
+    Account(shared_ptr<User> usr) : user(move(usr)), fineAmount(0) {}
     
-    void removeBook(vector<Book>& books, const string& booTitle) {
-        auto it = find_if(books.begin(), books.end(), [&](const Book& bk) {
-            return bk.getTitle() == booTitle;
-        });
-        if (it != books.end()) {
-            books.erase(it);
-            cout << "Removed '" << booTitle << "'—gone like last night's pizza!" << endl;
-        } else {
-            cout << "Bummer, '" << booTitle << "' was not found." << endl;
+    const shared_ptr<User>& getUser() const { return user; }
+
+    // Null for roles that do not borrow
+    const BorrowerBase* getBorrower() const { return dynamic_cast<const BorrowerBase*>(user.get()); }
+
+    // Titles on loan, oldest first
+    vector<string> getBorrowedBooks() const {
+        vector<string> titles;
+        if (const BorrowerBase* borrower = getBorrower()) {
+            for (const auto& loan : borrower->getCurrentBooks())
+                titles.push_back(loan.first);
         }
+        return titles;
     }
-    
-    void displayBooks(const vector<Book>& books) const {
-        cout << "Here's the cool collection:" << endl;
-        for (const auto& bk : books)
-            bk.display();
-        cout << endl;
+
+    size_t loanCount() const {
+        const BorrowerBase* borrower = getBorrower();
+        return borrower ? borrower->getCurrentBooks().size() : 0;
     }
-};
 
+    // Re-applying loans and fines read from disk
+    void restoreLoan(const string& bookTitle, time_t bDay) {
+        if (BorrowerBase* borrower = editBorrower())
+            borrower->restoreLoan(bookTitle, bDay);
+    }
 
-class Account 
-{
-private:
-    shared_ptr<User> user;
-    vector<string> borrowedBooksList;  
-    double fineAmount;          
-    
-public:
-    Account(shared_ptr<User> usr) : user(usr), fineAmount(0) 
-    {
-        syncBorrowedBooks();
+    void dropLoan(const string& bookTitle) {
+        if (BorrowerBase* borrower = editBorrower())
+            borrower->dropLoan(bookTitle);
     }
-    
-    void syncBorrowedBooks() {
-        borrowedBooksList.clear();
-        if (user->getRole() == "Student") {
-            Student* stu = dynamic_cast<Student*>(user.get());
-            if (stu) {
-                for (const auto& pair : stu->getCurrentBooks())
-                    borrowedBooksList.push_back(pair.first);
-            }
-        } else if (user->getRole() == "Faculty") {
-            Faculty* fac = dynamic_cast<Faculty*>(user.get());
-            if (fac) {
-                for (const auto& pair : fac->getCurrentBooks())
-                    borrowedBooksList.push_back(pair.first);
-            }
-        }
+
+    void restoreFine(double fine) {
+        BorrowerBase* borrower = editBorrower();
+        if (borrower && borrower->chargesFines())
+            borrower->setFine(fine);
     }
-    
-    shared_ptr<User> getUser() const { return user; }
-    
-    void borrowBook(const string& bookTitle, time_t bDay, vector<Book>& books) {
-        auto it = find_if(books.begin(), books.end(), [&](const Book& bk) {
-            return bk.getTitle() == bookTitle && bk.getStatus() == "Available";
-        });
-        if (it == books.end()) {
-            cout << "The book '" << bookTitle << "' is not available." << endl;
+
+    // The user object and its loans, each charged to its own total
+    void addMemoryUsage(MemoryUsage& users, MemoryUsage& loans) const {
+        if (!user)
             return;
+        const BorrowerBase* borrower = getBorrower();
+        users.addShared(user->objectSize());
+        user->addMemoryUsage(users);
+        if (borrower)
+            borrower->addLoanUsage(loans);
+    }
+    
+    // copy is the catalog copy to mark as borrowed; null when none is available
+    bool borrowBook(const string& bookTitle, time_t bDay, Book* copy) {
+        if (!copy) {
+            out() << "The book '" << bookTitle << "' is not available.\n";
+            return false;
         }
-        bool success = false;
-        if (user->getRole() == "Student") {
-            Student* stu = dynamic_cast<Student*>(user.get());
-            if (stu)
-                success = stu->borrowBook(bookTitle, bDay);
-        } else if (user->getRole() == "Faculty") {
-            Faculty* fac = dynamic_cast<Faculty*>(user.get());
-            if (fac)
-                success = fac->borrowBook(bookTitle, bDay);
-        } else {
-            cout << "Librarians do not borrow books." << endl;
-            return;
+        BorrowerBase* borrower = editBorrower();
+        if (!borrower) {
+            out() << "Librarians do not borrow books.\n";
+            return false;
         }
+        bool success = borrower->borrowBook(bookTitle, bDay);
         if (success) {
-            borrowedBooksList.push_back(bookTitle);
-            it->setStatus("Borrowed");
-            it->setReservedBy(user->getName());
-            cout << "Book '" << bookTitle << "' has been borrowed." << endl;
+            copy->setStatus("Borrowed");
+            copy->setReservedBy(user->getName());
+            out() << "Book '" << bookTitle << "' has been borrowed.\n";
         }
+        return success;
     }
     
-    void returnBook(const string& bookTitle, time_t rDay, vector<Book>& books) {
-        bool success = false;
-        if (user->getRole() == "Student") {
-            Student* stu = dynamic_cast<Student*>(user.get());
-            if (stu)
-                success = stu->returnBook(bookTitle, rDay);
-        } else if (user->getRole() == "Faculty") {
-            Faculty* fac = dynamic_cast<Faculty*>(user.get());
-            if (fac)
-                success = fac->returnBook(bookTitle, rDay);
-        } else {
-            cout << "Librarians do not return books." << endl;
-            return;
+    // copy is the catalog copy to mark as available again; null when this library has none
+    bool returnBook(const string& bookTitle, time_t rDay, Book* copy) {
+        BorrowerBase* borrower = editBorrower();
+        if (!borrower) {
+            out() << "Librarians do not return books.\n";
+            return false;
         }
+        bool success = borrower->returnBook(bookTitle, rDay);
         if (success) {
-            auto it = find(borrowedBooksList.begin(), borrowedBooksList.end(), bookTitle);
-            if (it != borrowedBooksList.end())
-                borrowedBooksList.erase(it);
-            auto bookIt = find_if(books.begin(), books.end(), [&](const Book& bk) {
-                return bk.getTitle() == bookTitle;
-            });
-            if (bookIt != books.end()) {
-                bookIt->setStatus("Available");
-                bookIt->setReservedBy("");
-                cout << "Book '" << bookTitle << "' returned successfully." << endl;
+            if (copy) {
+                copy->setStatus("Available");
+                copy->setReservedBy("");
+                out() << "Book '" << bookTitle << "' returned successfully.\n";
             } else {
-                cout << "Warning: The book '" << bookTitle << "' was not found in the library collection." << endl;
+                out() << "Warning: The book '" << bookTitle << "' was not found in the library collection.\n";
             }
-            syncBorrowedBooks();
         }
+        return success;
     }
     
-    void payFine() {
-        if (user->getRole() == "Student") {
-            Student* stu = dynamic_cast<Student*>(user.get());
-            if (stu) {
-                stu->payFine();
-                fineAmount = stu->getFine();
-            }
+    // Returns the amount paid
+    double payFine(time_t day) {
+        double paid = 0;
+        const BorrowerBase* current = getBorrower();
+        if (current && current->chargesFines()) {
+            BorrowerBase* borrower = editBorrower();
+            borrower->updateFines(day);
+            paid = borrower->getFine();
+            borrower->payFine();
+            fineAmount = borrower->getFine();
         } else {
-            cout << "No fines applicable for your role." << endl;
+            out() << "No fines applicable for your role.\n";
         }
+        return paid;
     }
     
     void display() const {
         user->display();
-        cout << "Borrowed Books: ";
-        for (const auto& b : borrowedBooksList)
-            cout << b << ", ";
-        cout << "\nOutstanding Fine: " << fineAmount << " rupees" << endl;
+        out() << "Borrowed Books: ";
+        if (const BorrowerBase* borrower = getBorrower()) {
+            for (const auto& loan : borrower->getCurrentBooks())
+                out() << loan.first << ", ";
+        }
+        out() << "\nOutstanding Fine: " << fineAmount << " rupees\n";
     }
 };
-// Library class
-class Library 
+
+// Converting a day count since the epoch into a year*12 + (month-1) key
+int monthKeyFromDay(time_t day)
+{
+    long long z = day + 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    long long month = mp < 10 ? mp + 3 : mp - 9;
+    long long year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+    return (int)(year * 12 + month - 1);
+}
+
+// Append-only circulation history with pre-aggregated rollups for reports
+class CirculationLog
 {
 private:
-    vector<Book> books;
-    vector<Account> accounts;
-    
-public:
-    vector<Book>& getBooks() { return books; }
-    const vector<Book>& getBooks() const { return books; }
-    
-    void addBook(const Book& bk, const Librarian& lib) {
-        books.push_back(bk);
-        cout << "Librarian " << lib.getName() << " just tossed in '" << bk.getTitle() << "'." << endl;
-    }
-    
-    void removeBook(const string& booTitle, const Librarian& lib) {
-        auto it = find_if(books.begin(), books.end(), [&](const Book& bk) {
-            return bk.getTitle() == booTitle;
-        });
-        if (it != books.end()) {
-            books.erase(it);
-            cout << "Librarian " << lib.getName() << " booted out '" << booTitle << "'." << endl;
-        } else {
-            cout << "Oops, '" << booTitle << "' couldn't be found." << endl;
-        }
+    struct RoleLoanStats {
+        long long totalDays = 0;
+        long long loans = 0;
+    };
+    struct AuthorReturnStats {
+        long long overdue = 0;
+        long long returns = 0;
+    };
+
+    string logPath;
+    mutex fileMutex;        // lines are published from the branches' writer threads
+    ofstream logFile;
+    long long eventCount;
+
+    // Rollups, updated as each event is appended or replayed
+    map<int, unordered_map<string, int>> borrowsByMonth;
+    unordered_map<string, RoleLoanStats> loanStatsByRole;
+    unordered_map<string, AuthorReturnStats> returnStatsByAuthor;
+    unordered_map<string, vector<time_t>> openLoans;   // "userId\ttitle" -> borrow days
+    unordered_map<int, int> openLoansPerUser;
+    map<time_t, int> activeBorrowersOn;                 // users holding a loan, on each day the count changed
+
+    // Replayed lines only carry the role name; unknown roles never count as overdue
+    static int loanPeriodFor(const string& role) {
+        const BorrowerRole* found = findBorrowerRole(role);
+        return found ? found->loanDays : numeric_limits<int>::max();
     }
-    
-    void addAccount(Account acc, const Librarian& lib) {
-        cout << "Librarian " << lib.getName() << " added account for " << acc.getUser()->getName() << "." << endl;
-        accounts.push_back(std::move(acc));
+
+    static string loanKey(int userId, const string& title) {
+        return to_string(userId) + "\t" + title;
     }
-    
-    void removeAccount(const string& usrName, const Librarian& lib) {
-        auto it = find_if(accounts.begin(), accounts.end(), [&](const Account& acc) {
-            return acc.getUser()->getName() == usrName;
-        });
-        if (it != accounts.end()) {
-            accounts.erase(it);
-            cout << "Librarian " << lib.getName() << " axed account for " << usrName << "." << endl;
-        } else {
-            cout << "Account for " << usrName << " not found." << endl;
+
+    // Events mostly arrive in day order, so only the last few counts move
+    void changeActiveBorrowers(time_t day, int delta) {
+        auto it = activeBorrowersOn.lower_bound(day);
+        if (it == activeBorrowersOn.end() || it->first != day) {
+            int before = it == activeBorrowersOn.begin() ? 0 : prev(it)->second;
+            it = activeBorrowersOn.emplace_hint(it, day, before);
         }
+        for (; it != activeBorrowersOn.end(); ++it)
+            it->second += delta;
     }
-    
-    void displayBooks() const {
-        cout << "Library Books:" << endl;
-        for (const auto& bk : books)
-            bk.display();
+
+    void apply(char type, time_t day, int userId, const string& role, int loanDays, const string& title,
+               const string& author) {
+        eventCount++;
+        if (type == 'B') {
+            borrowsByMonth[monthKeyFromDay(day)][title]++;
+            openLoans[loanKey(userId, title)].push_back(day);
+            if (openLoansPerUser[userId]++ == 0)
+                changeActiveBorrowers(day, 1);
+        } else if (type == 'R') {
+            auto it = openLoans.find(loanKey(userId, title));
+            if (it == openLoans.end() || it->second.empty())
+                return;
+            time_t borrowed = it->second.front();
+            it->second.erase(it->second.begin());
+            if (it->second.empty())
+                openLoans.erase(it);
+
+            long long days = day - borrowed;
+            RoleLoanStats& roleStats = loanStatsByRole[role];
+            roleStats.totalDays += days;
+            roleStats.loans++;
+
+            AuthorReturnStats& authorStats = returnStatsByAuthor[author];
+            authorStats.returns++;
+            if (days > loanDays)
+                authorStats.overdue++;
+
+            if (--openLoansPerUser[userId] == 0) {
+                openLoansPerUser.erase(userId);
+                changeActiveBorrowers(day, -1);
+            }
+        }
     }
-    
-    void displayAccounts() const {
-        cout << "Library Accounts:" << endl;
-        for (const auto& acc : accounts)
-            acc.display();
+
+    // Counting the event now; its line is returned for publish() once the change is saved
+    string record(char type, time_t day, int userId, const string& role, int loanDays, const string& title,
+                  const string& author, double amount) {
+        apply(type, day, userId, role, loanDays, title, author);
+        ostringstream line;
+        line << type << '\t' << day << '\t' << userId << '\t' << role << '\t'
+             << title << '\t' << author << '\t' << amount << '\n';
+        return line.str();
     }
-    
-    vector<Account>& getAccounts() { return accounts; }
-    
-    // Loading the library state from files
-    void loadState() 
-    {
-        try {
-            ifstream bookFile("books.txt");
-            if (bookFile.is_open()) {
-                string line;
-                while (getline(bookFile, line)) {
-                    stringstream ss(line);
-                    string title, author, publisher, yearStr, ISBN, status, reservedBy;
-                    getline(ss, title, ',');
-                    getline(ss, author, ',');
-                    getline(ss, publisher, ',');
-                    getline(ss, yearStr, ',');
-                    getline(ss, ISBN, ',');
-                    getline(ss, status, ',');
-                    getline(ss, reservedBy, ',');
 
-                    Book book(title, author, publisher, stoi(yearStr), ISBN);
-                    book.setStatus(status);
-                    book.setReservedBy(reservedBy);
-                    books.push_back(book);
-                }
-                bookFile.close();
-                cout << "Books loaded successfully." << endl;
-            } else {
-                cout << "No existing books file found. Starting with empty library." << endl;
+public:
+    CirculationLog(const string& path) : logPath(path), eventCount(0) {
+        ifstream existing(logPath);
+        string line;
+        while (getline(existing, line)) {
+            stringstream ss(line);
+            string typeStr, dayStr, idStr, role, title, author;
+            getline(ss, typeStr, '\t');
+            getline(ss, dayStr, '\t');
+            getline(ss, idStr, '\t');
+            getline(ss, role, '\t');
+            getline(ss, title, '\t');
+            getline(ss, author, '\t');
+            if (typeStr.size() != 1 || dayStr.empty() || idStr.empty())
+                continue;
+            try {
+                apply(typeStr[0], stoll(dayStr), stoi(idStr), role, loanPeriodFor(role), title, author);
+            } catch (const exception& e) {
+                cerr << "Skipping bad circulation record: " << e.what() << endl;
             }
-        } catch (const exception& e) {
-            cerr << "Error loading books: " << e.what() << endl;
         }
+        logFile.open(logPath, ios::app);
+        if (!logFile.is_open())
+            cerr << "Error: Could not open " << logPath << " for appending" << endl;
+    }
 
-        try {
-            ifstream accountFile("accounts.txt");
-            if (accountFile.is_open()) {
-                string accountLine;
-                while (getline(accountFile, accountLine)) {
-                    stringstream ss(accountLine);
-                    string name, idStr, role, bookStr, fineStr;
-                    getline(ss, name, ',');
-                    getline(ss, idStr, ',');
-                    getline(ss, role, ',');
-
-                    int id = stoi(idStr);
-                    shared_ptr<User> newUser;
-
-                    if (role == "Student") {
-                        auto student = make_shared<Student>(name, id);
-                        while (getline(ss, bookStr, ',') && !bookStr.empty() && bookStr.find(':') != string::npos) {
-                            stringstream bookSS(bookStr);
-                            string bookTitle;
-                            time_t borrowDate;
-                            getline(bookSS, bookTitle, ':');
-                            bookSS >> borrowDate;
-                            student->borrowBook(bookTitle, borrowDate);
-                        }
-                        
-                        // The last item should be the fine
-                        if (!bookStr.empty() && bookStr.find(':') == string::npos) {
-                            fineStr = bookStr;
-                        } else if (getline(ss, fineStr, ',')) {
-                            // Here we are extracting the fine if there's still more to read
-                        }
-                        
-                        try {
-                            if (!fineStr.empty()) {
-                                student->setFine(stod(fineStr));
-                            }
-                        } catch (const exception& e) {
-                            cerr << "Error parsing fine: " << e.what() << " for " << name << endl;
-                            student->setFine(0);
-                        }
-                        newUser = student;
-                    } else if (role == "Faculty") {
-                        auto faculty = make_shared<Faculty>(name, id);
-                        while (getline(ss, bookStr, ',') && !bookStr.empty() && bookStr.find(':') != string::npos) {
-                            stringstream bookSS(bookStr);
-                            string bookTitle;
-                            time_t borrowDate;
-                            getline(bookSS, bookTitle, ':');
-                            bookSS >> borrowDate;
-                            faculty->borrowBook(bookTitle, borrowDate);
-                        }
-                        newUser = faculty;
-                    } else if (role == "Librarian") {
-                        newUser = make_shared<Librarian>(name, id);
-                    }
+    string recordBorrow(time_t day, const BorrowerBase& borrower, const string& title, const string& author) {
+        return record('B', day, borrower.getId(), borrower.getRole(), borrower.getLoanDays(), title, author, 0);
+    }
 
-                    if (newUser) {
-                        accounts.push_back(Account(newUser));
-                    }
-                }
-                accountFile.close();
-                cout << "Accounts loaded successfully." << endl;
-            } else {
-                cout << "No existing accounts file found. Starting with empty accounts." << endl;
-                // Creating a default librarian account if there are no accounts
-                if (accounts.empty()) {
-                    auto defaultLibrarian = make_shared<Librarian>("Admin", 1);
-                    accounts.push_back(Account(defaultLibrarian));
-                    cout << "Created default librarian account (Name: Admin, ID: 1)" << endl;
-                }
-            }
-        } catch (const exception& e) {
-            cerr << "Error loading accounts: " << e.what() << endl;
-            // Creating a default librarian account if there was an error
-            if (accounts.empty()) {
-                auto defaultLibrarian = make_shared<Librarian>("Admin", 1);
-                accounts.push_back(Account(defaultLibrarian));
-                cout << "Created default librarian account (Name: Admin, ID: 1)" << endl;
-            }
+    string recordReturn(time_t day, const BorrowerBase& borrower, const string& title, const string& author) {
+        return record('R', day, borrower.getId(), borrower.getRole(), borrower.getLoanDays(), title, author, 0);
+    }
+
+    string recordFinePaid(time_t day, const BorrowerBase& borrower, double amount) {
+        return record('F', day, borrower.getId(), borrower.getRole(), borrower.getLoanDays(), "", "", amount);
+    }
+
+    // Appending recorded lines once the changes they describe are on disk
+    void publish(const string& lines) {
+        lock_guard<mutex> hold(fileMutex);
+        if (!logFile.is_open())
+            return;
+        logFile << lines;
+        logFile.flush();
+    }
+
+    long long getEventCount() const { return eventCount; }
+
+    void displayTopTitles(int year, int month, size_t k) const {
+        // Month 13 would otherwise read January of the next year
+        if (month < 1 || month > 12) {
+            out() << "Invalid month. Please enter a month from 1 to 12.\n";
+            return;
         }
+        out() << "Most borrowed titles in " << year << "-" << (month < 10 ? "0" : "") << month << ":\n";
+        auto it = borrowsByMonth.find(year * 12 + month - 1);
+        if (it == borrowsByMonth.end()) {
+            out() << "No borrowing recorded for that month.\n";
+            return;
+        }
+        vector<pair<string, int>> ranked(it->second.begin(), it->second.end());
+        size_t shown = min(k, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(),
+                     [](const pair<string, int>& a, const pair<string, int>& b) {
+                         return a.second != b.second ? a.second > b.second : a.first < b.first;
+                     });
+        for (size_t i = 0; i < shown; i++)
+            out() << i + 1 << ". " << ranked[i].first << " (" << ranked[i].second << " loans)\n";
     }
 
-    // Saving the library state to files
-    void saveState() const {
-        try {
-            ofstream bookFile("books.txt");
-            if (!bookFile.is_open()) {
-                cerr << "Error: Could not open books.txt for writing" << endl;
-                return;
-            }
-            
-            for (const auto& book : books) {
-                bookFile << book.getTitle() << "," << book.getAuthor() << "," << book.getPublisher() << ","
-                         << book.getYear() << "," << book.getISBN() << "," << book.getStatus() << "," << book.getReservedBy() << "\n";
-            }
-            bookFile.close();
-            cout << "Books saved successfully." << endl;
-        } catch (const exception& e) {
-            cerr << "Error saving books: " << e.what() << endl;
+    void displayLoanDurationByRole() const {
+        out() << "Average loan duration by role:\n";
+        if (loanStatsByRole.empty())
+            out() << "No returns recorded yet.\n";
+        for (const auto& entry : loanStatsByRole) {
+            out() << entry.first << ": " << (double)entry.second.totalDays / entry.second.loans
+                 << " days over " << entry.second.loans << " loans\n";
         }
+    }
 
-        try {
-            ofstream accountFile("accounts.txt");
-            if (!accountFile.is_open()) {
-                cerr << "Error: Could not open accounts.txt for writing" << endl;
-                return;
-            }
-            
-            for (const auto& account : accounts) {
-                if (account.getUser() == nullptr) continue;
-                
-                accountFile << account.getUser()->getName() << "," << account.getUser()->getId() << ","
-                           << account.getUser()->getRole() << ",";
-                
-                if (account.getUser()->getRole() == "Student") {
-                    Student* student = dynamic_cast<Student*>(account.getUser().get());
-                    if (student) {
-                        for (const auto& book : student->getCurrentBooks()) {
-                            accountFile << book.first << ":" << book.second << ",";
-                        }
-                        accountFile << student->getFine();
-                    }
-                } else if (account.getUser()->getRole() == "Faculty") {
-                    Faculty* faculty = dynamic_cast<Faculty*>(account.getUser().get());
-                    if (faculty) {
-                        for (const auto& book : faculty->getCurrentBooks()) {
-                            accountFile << book.first << ":" << book.second << ",";
-                        }
-                    }
-                }
-                
-                accountFile << "\n";
-            }
-            accountFile.close();
-            cout << "Accounts saved successfully." << endl;
-        } catch (const exception& e) {
-            cerr << "Error saving accounts: " << e.what() << endl;
+    void displayOverdueRateByAuthor(size_t k) const {
+        out() << "Overdue rate by author:\n";
+        vector<pair<string, AuthorReturnStats>> ranked(returnStatsByAuthor.begin(), returnStatsByAuthor.end());
+        auto rate = [](const AuthorReturnStats& st) { return (double)st.overdue / st.returns; };
+        size_t shown = min(k, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(),
+                     [&](const pair<string, AuthorReturnStats>& a, const pair<string, AuthorReturnStats>& b) {
+                         return rate(a.second) != rate(b.second) ? rate(a.second) > rate(b.second) : a.first < b.first;
+                     });
+        if (ranked.empty())
+            out() << "No returns recorded yet.\n";
+        for (size_t i = 0; i < shown; i++) {
+            out() << ranked[i].first << ": " << rate(ranked[i].second) * 100 << "% overdue ("
+                 << ranked[i].second.overdue << " of " << ranked[i].second.returns << " returns)\n";
+        }
+    }
+
+    void displayActiveBorrowers(time_t fromDay, time_t toDay) const {
+        out() << "Active borrowers per day:\n";
+        auto it = activeBorrowersOn.upper_bound(fromDay);
+        int active = it == activeBorrowersOn.begin() ? 0 : prev(it)->second;
+        for (time_t day = fromDay; day <= toDay; day++) {
+            if (it != activeBorrowersOn.end() && it->first == day)
+                active = (it++)->second;
+            int key = monthKeyFromDay(day);
+            out() << "Day " << day << " (" << key / 12 << "-" << (key % 12 + 1 < 10 ? "0" : "") << key % 12 + 1
+                 << "): " << active << '\n';
         }
     }
 };
 
-int main() 
+// Ordered change feed for downstream systems (discovery portal, accounting). Every
+// mutation is appended to the log as one tab-separated line:
+//   sequence  day  branch  event  fields...
+//   BOOK_ADDED       bookId title author publisher year isbn
+//   BOOK_REMOVED     bookId title
+//   LOAN_OPENED      userId bookId title fine      (the copy is now Borrowed)
+//   LOAN_CLOSED      userId bookId title fine      (the copy is Available again)
+//   FINE_PAID        userId amount fine
+//   ACCOUNT_ADDED    userId name role
+//   ACCOUNT_REMOVED  userId name
+// Sequence numbers carry on across runs. The byte offset of every 256th event goes to a
+// small side index, so a consumer resuming from a sequence number seeks close to it
+// instead of reading the log from the start.
+class ChangeStream
 {
-    Library library;
+private:
+    static const long long indexEvery = 256;
 
-    // Loading library state from files (if they exist)
-    library.loadState();
+    string logPath;
+    mutex fileMutex;        // events are published from the branches' writer threads
+    ofstream logFile;
+    ofstream indexFile;
+    long long lastSequence;
+    long long logBytes;
 
-    while (true) 
-    {
-        cout << "\n------------------------------------------" << endl;
-        cout << "Welcome to the the IITK Library Management System!" << endl;
-        cout << "------------------------------------------" << endl;
-        cout << "Please select your role:" << endl;
-        cout << "1. Student" << endl;
-        cout << "2. Faculty" << endl;
-        cout << "3. Librarian" << endl;
-        cout << "4. Exit" << endl;
-        cout << "Enter your choice: ";
-
-        int roleChoice;
-        cin >> roleChoice;
-
-        if (roleChoice == 4) 
-        {
-            // Save state before exiting
-            library.saveState();
-            cout << "Thank you for using the Library Management System. Goodbye!" << endl;
-            break;
+    static string indexPathFor(const string& path) { return path + ".idx"; }
+
+    // Tabs and newlines would break the line format
+    static string field(string text) {
+        replace(text.begin(), text.end(), '\t', ' ');
+        replace(text.begin(), text.end(), '\n', ' ');
+        return text;
+    }
+
+    static long long sequenceOf(const string& line) { return strtoll(line.c_str(), nullptr, 10); }
+
+    static long long fileSize(const string& path) {
+        ifstream file(path, ios::binary | ios::ate);
+        return file.is_open() ? (long long)file.tellg() : 0;
+    }
+
+    // (sequence, byte offset of its line) pairs, dropping any that point past the log's end
+    static vector<pair<long long, long long>> readIndex(const string& path, long long logSize) {
+        vector<pair<long long, long long>> index;
+        ifstream indexIn(indexPathFor(path));
+        long long seq, offset;
+        while (indexIn >> seq >> offset) {
+            if (offset > logSize || (!index.empty() && seq <= index.back().first))
+                break;
+            index.push_back(make_pair(seq, offset));
         }
+        return index;
+    }
 
-        string userName;
-        int userId;
-        cout << "Enter your name: ";
-        cin.ignore(); // Here we are clearing the input buffer
-        getline(cin, userName);
-        cout << "Enter your ID: ";
-        cin >> userId;
-        cin.ignore(); // Here we are clearing the input buffer
+    // Offset of the indexed line at or before the first event after sequence
+    static long long seekOffset(const vector<pair<long long, long long>>& index, long long sequence) {
+        long long offset = 0;
+        for (const auto& entry : index) {
+            if (entry.first > sequence + 1)
+                break;
+            offset = entry.second;
+        }
+        return offset;
+    }
 
-        // Here we have implemented the faculty role handling
-        if (roleChoice == 2) 
-        {
-            bool accountFound = false;
-            Account* facultyAccount = nullptr;
-            
-            for (auto& account : library.getAccounts()) 
-            {
-                if (account.getUser()->getName() == userName && 
-                    account.getUser()->getId() == userId) {
-                    
-
-                    if (account.getUser()->getRole() != "Faculty") 
-                    {
-                        cout << "Error: User '" << userName << "' exists but is not a faculty member." << endl;
-                        cout << "This user has role: " << account.getUser()->getRole() << endl;
-                        accountFound = true;
-                        break;
-                    }
-                    
-                    facultyAccount = &account;
-                    accountFound = true;
-                    break;
-                }
-            }
-            
-            if (!accountFound) 
-            {
-                cout << "No account found with name '" << userName << "' and ID " << userId << "." << endl;
-                cout << "Please contact a librarian to create an account." << endl;
-                continue;
-            }
-            
-            if (facultyAccount == nullptr) 
-            {
-                continue;
-            }
+    // An event line without its sequence number, which publish() adds
+    static string record(time_t day, const string& branch, const char* event, const string& fields) {
+        ostringstream line;
+        line << day << '\t' << field(branch) << '\t' << event << fields << '\n';
+        return line.str();
+    }
 
-            Faculty* faculty = dynamic_cast<Faculty*>(facultyAccount->getUser().get());
-            if (!faculty) 
-            {
-                cout << "Error: Failed to access faculty data. Please try again." << endl;
-                continue;
+public:
+    ChangeStream(const string& path) : logPath(path), lastSequence(0), logBytes(0) {
+        // Picking up the sequence from the last indexed event on; a line left half-written
+        // by a crash is cut off so the next event starts on a fresh line. Numbering carries on
+        // past the last indexed sequence even if its line was lost, so it never restarts.
+        long long size = fileSize(logPath);
+        vector<pair<long long, long long>> index = readIndex(logPath, size);
+        if (!index.empty())
+            lastSequence = index.back().first;
+        vector<pair<long long, long long>> missing;
+        long long pos = index.empty() ? 0 : index.back().second;
+        ifstream existing(logPath, ios::binary);
+        existing.seekg(pos);
+        string line;
+        while (getline(existing, line) && !existing.eof()) {
+            long long seq = sequenceOf(line);
+            if (seq > lastSequence) {
+                lastSequence = seq;
+                if (seq % indexEvery == 0 && (index.empty() || seq > index.back().first))
+                    missing.push_back(make_pair(seq, pos));
             }
+            pos += line.size() + 1;
+        }
+        existing.close();
+        if (pos < size && truncate(logPath.c_str(), pos) != 0)
+            cerr << "Error: Could not trim the partial last line of " << logPath << endl;
+        logBytes = pos;
 
-            bool facultySessionActive = true;
-            while (facultySessionActive) 
-            {
-                cout << "\n------------------------------------------" << endl;
-                cout << "Faculty Menu:" << endl;
-                cout << "------------------------------------------" << endl;
-                cout << "1. Borrow Book" << endl;
-                cout << "2. Return Book" << endl;
-                cout << "3. Display Account" << endl;
-                cout << "4. Display Available Books" << endl;
-                cout << "5. Exit" << endl;
-                cout << "Enter your choice: ";
-
-                int facultyChoice;
-                cin >> facultyChoice;
-
-                if (facultyChoice == 5) 
-                {
-                    facultySessionActive = false;
-                    break;
-                }
+        // Rewriting the index (one line per 256 events) without stale entries and with any
+        // the last run did not get to write
+        index.insert(index.end(), missing.begin(), missing.end());
+        indexFile.open(indexPathFor(logPath), ios::trunc);
+        for (const auto& entry : index)
+            indexFile << entry.first << ' ' << entry.second << '\n';
+        indexFile.flush();
+        logFile.open(logPath, ios::app | ios::binary);
+        if (!logFile.is_open())
+            cerr << "Error: Could not open " << logPath << " for appending" << endl;
+    }
 
-                if (facultyChoice == 1) 
-                {
-                    string bookTitle;
-                    cout << "Enter the book title: ";
-                    cin.ignore();
-                    getline(cin, bookTitle);
-                    time_t currentDate = getCurrentDate();
-                    facultyAccount->borrowBook(bookTitle, currentDate, library.getBooks());
-                    library.saveState();
-                } 
-                else if (facultyChoice == 2) 
-                {
-                    string bookTitle;
-                    cout << "Enter the book title: ";
-                    cin.ignore();
-                    getline(cin, bookTitle);
-                    time_t currentDate = getCurrentDate();
-                    facultyAccount->returnBook(bookTitle, currentDate, library.getBooks());
-                    library.saveState();
-                } 
-                else if (facultyChoice == 3) 
-                {
-                    faculty->display();
-                } 
-                else if (facultyChoice == 4) 
-                {
-                    library.displayBooks();
-                } 
-                else 
-                {
-                    cout << "Invalid choice. Please try again." << endl;
-                }
-            }
-        } 
-        else if (roleChoice == 1) 
-        {
-            bool accountFound = false;
-            Account* studentAccount = nullptr;
-            
-            for (auto& account : library.getAccounts()) {
-                if (account.getUser()->getName() == userName && 
-                    account.getUser()->getId() == userId) 
-                    {
-                    if (account.getUser()->getRole() != "Student") 
-                    {
-                        cout << "Error: User '" << userName << "' exists but is not a student." << endl;
-                        cout << "This user has role: " << account.getUser()->getRole() << endl;
-                        accountFound = true;
-                        break;
-                    }
-                    
-                    studentAccount = &account;
-                    accountFound = true;
-                    break;
-                }
-            }
-            
-            if (!accountFound) 
-            {
-                cout << "No account found with name '" << userName << "' and ID " << userId << "." << endl;
-                cout << "Please contact a librarian to create an account." << endl;
-                continue;
-            }
-            
-            if (studentAccount == nullptr) 
-            {
-                continue;
-            }
+    long long getLastSequence() {
+        lock_guard<mutex> hold(fileMutex);
+        return lastSequence;
+    }
 
-            Student* student = dynamic_cast<Student*>(studentAccount->getUser().get());
-            if (!student) 
-            {
-                cout << "Error: Failed to access student data. Please try again." << endl;
-                continue;
-            }
+    // Numbering and appending events recorded below, called by a branch's writer once the
+    // state they describe is on disk. Events never run ahead of the saved files; a crash
+    // between the save and this call loses them instead.
+    void publish(const string& lines) {
+        lock_guard<mutex> hold(fileMutex);
+        if (!logFile.is_open())
+            return;
+        string text;
+        vector<pair<long long, long long>> indexed;
+        size_t start = 0;
+        while (start < lines.size()) {
+            size_t end = lines.find('\n', start);
+            end = end == string::npos ? lines.size() : end + 1;
+            long long seq = ++lastSequence;
+            if (seq % indexEvery == 0)
+                indexed.push_back(make_pair(seq, logBytes + (long long)text.size()));
+            text += to_string(seq);
+            text += '\t';
+            text.append(lines, start, end - start);
+            start = end;
+        }
+        // The lines go out before their index entries, so an entry never points past the log
+        logFile << text;
+        logFile.flush();
+        logBytes += text.size();
+        for (const auto& entry : indexed)
+            indexFile << entry.first << ' ' << entry.second << '\n';
+        if (!indexed.empty())
+            indexFile.flush();
+    }
 
-            bool studentSessionActive = true;
-            while (studentSessionActive) 
-            {
-                cout << "\n------------------------------------------" << endl;
-                cout << "Student Menu:" << endl;
-                cout << "------------------------------------------" << endl;
-                cout << "1. Borrow Book" << endl;
-                cout << "2. Return Book" << endl;
-                cout << "3. Pay Fine" << endl;
-                cout << "4. Display Account" << endl;
-                cout << "5. Display Available Books" << endl;
-                cout << "6. Exit" << endl;
-                cout << "Enter your choice: ";
-
-                int studentChoice;
-                cin >> studentChoice;
-
-                if (studentChoice == 6) 
-                {
-                    studentSessionActive = false;
-                    break;
-                }
+    static string bookAdded(time_t day, const string& branch, const Book& bk) {
+        ostringstream f;
+        f << '\t' << bk.getId() << '\t' << field(bk.getTitle()) << '\t' << field(bk.getAuthor()) << '\t'
+          << field(bk.getPublisher()) << '\t' << bk.getYear() << '\t' << field(bk.getISBN());
+        return record(day, branch, "BOOK_ADDED", f.str());
+    }
 
-                if (studentChoice == 1) 
-                {
-                    string bookTitle;
-                    cout << "Enter the book title: ";
-                    cin.ignore();
-                    getline(cin, bookTitle);
-                    time_t currentDate = getCurrentDate();
-                    
-                    // Here we are using the Account's borrowBook method which properly updates both user and book data
-                    studentAccount->borrowBook(bookTitle, currentDate, library.getBooks());
-                    library.saveState();
-                } 
-                else if (studentChoice == 2) 
-                {
-                    string bookTitle;
-                    cout << "Enter the book title: ";
-                    cin.ignore();
-                    getline(cin, bookTitle);
-                    time_t currentDate = getCurrentDate();
-                    studentAccount->returnBook(bookTitle, currentDate, library.getBooks());
-                    library.saveState();
-                } 
-                else if (studentChoice == 3) 
-                {
-                    studentAccount->payFine();
-                    library.saveState();
-                } 
-                else if (studentChoice == 4) 
-                {
-                    student->display();
-                } 
-                else if (studentChoice == 5) 
-                {
-                    library.displayBooks();
-                } 
-                else 
-                {
-                    cout << "Invalid choice. Please try again." << endl;
-                }
-            }
-        } 
-        else if (roleChoice == 3) 
-        {
-            bool accountFound = false;
-            Account* librarianAccount = nullptr;
-            
-            for (auto& account : library.getAccounts()) 
-            {
-                if (account.getUser()->getName() == userName && 
-                    account.getUser()->getId() == userId) {
-                    
-
-                    if (account.getUser()->getRole() != "Librarian") 
-                    {
-                        cout << "Error: User '" << userName << "' exists but is not a librarian." << endl;
-                        cout << "This user has role: " << account.getUser()->getRole() << endl;
-                        accountFound = true;
-                        break;
-                    }
-                    
-                    librarianAccount = &account;
-                    accountFound = true;
-                    break;
-                }
-            }
-            
-            if (!accountFound) 
-            {
-                cout << "No account found with name '" << userName << "' and ID " << userId << "." << endl;
-                if (userName == "Admin" && userId == 1) 
-                {
-                    cout << "Creating default librarian account..." << endl;
-                    auto defaultLibrarian = make_shared<Librarian>("Admin", 1);
-                    library.getAccounts().push_back(Account(defaultLibrarian));
-                    librarianAccount = &library.getAccounts().back();
-                    library.saveState();
-                } 
-                else 
-                {
-                    cout << "Please use the default librarian account (Admin, ID: 1) to create new accounts." << endl;
-                    continue;
-                }
-            }
-            
-            if (librarianAccount == nullptr) 
-            {
-                continue;
-            }
+    static string bookRemoved(time_t day, const string& branch, const Book& bk) {
+        return record(day, branch, "BOOK_REMOVED", '\t' + to_string(bk.getId()) + '\t' + field(bk.getTitle()));
+    }
 
-            Librarian* librarian = dynamic_cast<Librarian*>(librarianAccount->getUser().get());
-            if (!librarian) 
-            {
-                cout << "Error: Failed to access librarian data. Please try again." << endl;
-                continue;
-            }
+    static string loanOpened(time_t day, const string& branch, const User& user, int bookId, const string& title, double fine) {
+        ostringstream f;
+        f << '\t' << user.getId() << '\t' << bookId << '\t' << field(title) << '\t' << fine;
+        return record(day, branch, "LOAN_OPENED", f.str());
+    }
 
-            bool librarianSessionActive = true;
-            while (librarianSessionActive) 
-            {
-                cout << "\n------------------------------------------" << endl;
-                cout << "Librarian Menu:" << endl;
-                cout << "------------------------------------------" << endl;
-                cout << "1. Add Book" << endl;
-                cout << "2. Remove Book" << endl;
-                cout << "3. Add Account" << endl;
-                cout << "4. Remove Account" << endl;
-                cout << "5. Display Books" << endl;
-                cout << "6. Display Accounts" << endl;
-                cout << "7. Exit" << endl;
-                cout << "Enter your choice: ";
-
-                int librarianChoice;
-                cin >> librarianChoice;
-
-                if (librarianChoice == 7) 
-                {
-                    librarianSessionActive = false;
-                    break;
-                }
+    static string loanClosed(time_t day, const string& branch, const User& user, int bookId, const string& title, double fine) {
+        ostringstream f;
+        f << '\t' << user.getId() << '\t' << bookId << '\t' << field(title) << '\t' << fine;
+        return record(day, branch, "LOAN_CLOSED", f.str());
+    }
 
-                if (librarianChoice == 1) 
-                {
-                    string title, author, publisher, ISBN;
-                    int year;
-                    
-                    cout << "Enter book title: ";
-                    cin.ignore();
-                    getline(cin, title);
-                    
-                    cout << "Enter author: ";
-                    getline(cin, author);
-                    
-                    cout << "Enter publisher: ";
-                    getline(cin, publisher);
-                    
-                    cout << "Enter year: ";
-                    cin >> year;
-                    
-                    cout << "Enter ISBN: ";
-                    cin.ignore();
-                    getline(cin, ISBN);
-                    
-                    Book newBook(title, author, publisher, year, ISBN);
-                    librarian->addBook(library.getBooks(), newBook);
-                    library.saveState();
-                } 
-                else if (librarianChoice == 2) 
-                {
-                    string bookTitle;
-                    cout << "Enter the book title to remove: ";
-                    cin.ignore();
-                    getline(cin, bookTitle);
-                    
-                    librarian->removeBook(library.getBooks(), bookTitle);
-                    library.saveState();
-                } 
-                else if (librarianChoice == 3) 
-                {
-                    string newUserName;
-                    int newUserId;
-                    int userType;
-                    
-                    cout << "Enter new user name: ";
-                    cin.ignore();
-                    getline(cin, newUserName);
-                    
-                    cout << "Enter new user ID: ";
-                    cin >> newUserId;
-                    
-                    cout << "Select user type:" << endl;
-                    cout << "1. Student" << endl;
-                    cout << "2. Faculty" << endl;
-                    cout << "3. Librarian" << endl;
-                    cout << "Enter choice: ";
-                    cin >> userType;
-                    
-                    shared_ptr<User> newUser;
-                    if (userType == 1) 
-                    {
-                        newUser = make_shared<Student>(newUserName, newUserId);
-                    } 
-                    else if (userType == 2) 
-                    {
-                        newUser = make_shared<Faculty>(newUserName, newUserId);
-                    } 
-                    else if (userType == 3) 
-                    {
-                        newUser = make_shared<Librarian>(newUserName, newUserId);
-                    } 
-                    else 
-                    {
-                        cout << "Invalid user type. Account creation failed." << endl;
-                        continue;
+    static string finePaid(time_t day, const string& branch, const User& user, double amount, double fine) {
+        ostringstream f;
+        f << '\t' << user.getId() << '\t' << amount << '\t' << fine;
+        return record(day, branch, "FINE_PAID", f.str());
+    }
+
+    static string accountAdded(time_t day, const string& branch, const User& user) {
+        ostringstream f;
+        f << '\t' << user.getId() << '\t' << field(user.getName()) << '\t' << user.getRole();
+        return record(day, branch, "ACCOUNT_ADDED", f.str());
+    }
+
+    static string accountRemoved(time_t day, const string& branch, const User& user) {
+        return record(day, branch, "ACCOUNT_REMOVED", '\t' + to_string(user.getId()) + '\t' + field(user.getName()));
+    }
+
+    // Copying every complete event after sequence from the log at path to os; returns the
+    // last sequence number copied, or sequence itself when there was nothing new
+    static long long copySince(const string& path, long long sequence, ostream& os) {
+        ifstream log(path, ios::binary);
+        if (!log.is_open())
+            return sequence;
+        log.seekg(seekOffset(readIndex(path, fileSize(path)), sequence));
+        string line;
+        while (getline(log, line) && !log.eof()) {
+            long long seq = sequenceOf(line);
+            if (seq > sequence) {
+                os << line << '\n';
+                sequence = seq;
+            }
+        }
+        return sequence;
+    }
+};
+
+const long long ChangeStream::indexEvery;
+
+// Approximate title matching over a trigram index of normalized titles.
+// Lookups only visit titles sharing trigrams with the query, and edit distance
+// is computed for a bounded number of the best candidates.
+class TitleIndex
+{
+private:
+    struct Entry {
+        string normalized;
+        vector<string> titles;   // original spellings, one per copy
+        vector<int> positions;   // where this slot sits in the posting list of each of its trigrams
+    };
+
+    static const size_t maxPostingsScanned = 4096;
+    static const size_t maxCandidates = 64;
+
+    vector<Entry> entries;
+    vector<int> freeSlots;
+    unordered_map<string, int> slotByNormalized;
+    unordered_map<unsigned, vector<int>> postings;
+
+    static vector<unsigned> trigrams(const string& normalized) {
+        string padded = "  " + normalized + " ";
+        vector<unsigned> grams;
+        for (size_t i = 0; i + 3 <= padded.size(); i++) {
+            grams.push_back(((unsigned)(unsigned char)padded[i] << 16) |
+                            ((unsigned)(unsigned char)padded[i + 1] << 8) |
+                            (unsigned)(unsigned char)padded[i + 2]);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    static size_t editDistance(const string& a, const string& b) {
+        vector<size_t> prev(b.size() + 1), cur(b.size() + 1);
+        for (size_t j = 0; j <= b.size(); j++)
+            prev[j] = j;
+        for (size_t i = 1; i <= a.size(); i++) {
+            cur[0] = i;
+            for (size_t j = 1; j <= b.size(); j++) {
+                size_t substitution = prev[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+                cur[j] = min(substitution, min(prev[j], cur[j - 1]) + 1);
+            }
+            prev.swap(cur);
+        }
+        return prev[b.size()];
+    }
+
+public:
+    // Lowercase, apostrophes and dots dropped, other punctuation and runs of spaces folded to one space
+    static string normalize(const string& text) {
+        string out;
+        bool pendingSpace = false;
+        for (unsigned char c : text) {
+            if (isalnum(c)) {
+                if (pendingSpace && !out.empty())
+                    out += ' ';
+                pendingSpace = false;
+                out += (char)tolower(c);
+            } else if (c != '\'' && c != '.') {
+                pendingSpace = true;
+            }
+        }
+        return out;
+    }
+
+    void add(const string& title) {
+        string norm = normalize(title);
+        auto it = slotByNormalized.find(norm);
+        if (it != slotByNormalized.end()) {
+            entries[it->second].titles.push_back(title);
+            return;
+        }
+        int slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = (int)entries.size();
+            entries.push_back(Entry());
+        }
+        entries[slot].normalized = norm;
+        entries[slot].titles.assign(1, title);
+        slotByNormalized[norm] = slot;
+        entries[slot].positions.clear();
+        for (unsigned gram : trigrams(norm)) {
+            vector<int>& list = postings[gram];
+            entries[slot].positions.push_back((int)list.size());
+            list.push_back(slot);
+        }
+    }
+
+    void remove(const string& title) {
+        string norm = normalize(title);
+        auto it = slotByNormalized.find(norm);
+        if (it == slotByNormalized.end())
+            return;
+        int slot = it->second;
+        vector<string>& titles = entries[slot].titles;
+        auto pos = find(titles.begin(), titles.end(), title);
+        if (pos != titles.end())
+            titles.erase(pos);
+        if (!titles.empty())
+            return;
+
+        // Moving each list's last slot into the freed place; its own position for that
+        // trigram is found by binary search, as trigrams() returns them sorted
+        vector<unsigned> grams = trigrams(norm);
+        for (size_t i = 0; i < grams.size(); i++) {
+            auto found = postings.find(grams[i]);
+            vector<int>& list = found->second;
+            int at = entries[slot].positions[i];
+            int moved = list.back();
+            list[at] = moved;
+            list.pop_back();
+            if (moved != slot) {
+                vector<unsigned> movedGrams = trigrams(entries[moved].normalized);
+                size_t k = lower_bound(movedGrams.begin(), movedGrams.end(), grams[i]) - movedGrams.begin();
+                entries[moved].positions[k] = at;
+            }
+            if (list.empty())
+                postings.erase(found);
+        }
+        slotByNormalized.erase(it);
+        entries[slot].normalized.clear();
+        entries[slot].positions.clear();
+        freeSlots.push_back(slot);
+    }
+
+    void clear() {
+        entries.clear();
+        freeSlots.clear();
+        slotByNormalized.clear();
+        postings.clear();
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const {
+        usage.addVector(entries);
+        for (const auto& entry : entries) {
+            usage.addString(entry.normalized);
+            usage.addVector(entry.titles);
+            usage.addVector(entry.positions);
+            for (const auto& title : entry.titles)
+                usage.addString(title);
+        }
+        usage.addVector(freeSlots);
+        usage.addHashMap(slotByNormalized);
+        for (const auto& slot : slotByNormalized)
+            usage.addString(slot.first);
+        usage.addHashMap(postings);
+        for (const auto& list : postings)
+            usage.addVector(list.second);
+    }
+
+    // Titles equal to the query once case and punctuation are ignored
+    vector<string> exactMatches(const string& query) const {
+        auto it = slotByNormalized.find(normalize(query));
+        if (it == slotByNormalized.end())
+            return vector<string>();
+        vector<string> titles = entries[it->second].titles;
+        sort(titles.begin(), titles.end());
+        titles.erase(unique(titles.begin(), titles.end()), titles.end());
+        return titles;
+    }
+
+    // Closest titles as (edit distance, title), best first
+    vector<pair<size_t, string>> suggest(const string& query, size_t k) const {
+        string norm = normalize(query);
+        vector<unsigned> grams = trigrams(norm);
+
+        // Rare trigrams first; very common ones add little. At most maxPostingsScanned
+        // postings are read in all, so even a query made only of common trigrams stays bounded
+        vector<const vector<int>*> lists;
+        for (unsigned gram : grams) {
+            auto it = postings.find(gram);
+            if (it != postings.end())
+                lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<int>* a, const vector<int>* b) {
+            return a->size() < b->size();
+        });
+
+        unordered_map<int, int> shared;
+        size_t scanned = 0;
+        for (const vector<int>* list : lists) {
+            if (scanned >= maxPostingsScanned)
+                break;
+            size_t take = min(list->size(), maxPostingsScanned - scanned);
+            scanned += take;
+            for (size_t i = 0; i < take; i++)
+                shared[(*list)[i]]++;
+        }
+
+        vector<pair<int, int>> candidates;
+        for (const auto& entry : shared)
+            candidates.push_back(make_pair(entry.second, entry.first));
+        size_t kept = min(maxCandidates, candidates.size());
+        partial_sort(candidates.begin(), candidates.begin() + kept, candidates.end(),
+                     [](const pair<int, int>& a, const pair<int, int>& b) { return a.first > b.first; });
+        candidates.resize(kept);
+
+        vector<pair<size_t, string>> ranked;
+        for (const auto& cand : candidates) {
+            const Entry& entry = entries[cand.second];
+            size_t dist = editDistance(norm, entry.normalized);
+            // Rejecting candidates that differ in more than half their characters
+            if (dist * 2 <= max(norm.size(), entry.normalized.size()))
+                ranked.push_back(make_pair(dist, entry.titles.front()));
+        }
+        sort(ranked.begin(), ranked.end());
+        if (ranked.size() > k)
+            ranked.resize(k);
+        return ranked;
+    }
+};
+
+const size_t TitleIndex::maxPostingsScanned;
+const size_t TitleIndex::maxCandidates;
+
+// Prefix completion over normalized titles: a radix trie (single-child chains merged
+// into one node) with first-child/next-sibling links in one vector. Each node keeps
+// its subtree's best few titles, so a lookup is a walk down the typed prefix. Titles
+// with a copy on the shelf rank first, then the most borrowed, then alphabetical order.
+// Borrows and returns only mark the title's path as stale; the next lookup below a
+// stale node re-ranks just the stale part of that subtree
+class TitleCompleter
+{
+public:
+    static const size_t maxCompletions = 5;
+
+    struct Completion {
+        string title;
+        int available;      // copies on the shelf
+        int borrows;        // since the catalog was loaded, counting copies already out then
+    };
+
+private:
+    struct Entry {
+        string title;
+        int copies;
+        int available;
+        int borrows;
+        int nextAtNode;     // next entry ending at the same node, -1 at the end
+    };
+
+    struct Node {
+        string label;                   // characters from the parent to this node
+        int firstChild;
+        int nextSibling;
+        int firstEntry;                 // entries whose key ends here
+        int top[maxCompletions];        // best entries in this subtree, -1 padded
+        bool stale;                     // top needs ranking again; so do all ancestors
+    };
+
+    vector<Node> nodes;
+    vector<Entry> entries;
+    vector<int> freeSlots;
+    vector<int> path;                   // nodes from the root, filled by walk()
+
+    int newNode(const string& label) {
+        Node node;
+        node.label = label;
+        node.firstChild = node.nextSibling = node.firstEntry = -1;
+        fill(node.top, node.top + maxCompletions, -1);
+        node.stale = false;
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    int child(int parent, char ch) const {
+        for (int c = nodes[parent].firstChild; c >= 0; c = nodes[c].nextSibling) {
+            if (nodes[c].label[0] == ch)
+                return c;
+        }
+        return -1;
+    }
+
+    // Following key from the root, recording the nodes passed in path. Returns the node
+    // the key ends at, or -1 when it leaves the trie; with create, missing nodes are added
+    int walk(const string& key, bool create) {
+        path.assign(1, 0);
+        size_t pos = 0;
+        while (pos < key.size()) {
+            int parent = path.back();
+            int next = child(parent, key[pos]);
+            if (next < 0) {
+                if (!create)
+                    return -1;
+                next = newNode(key.substr(pos));
+                nodes[next].nextSibling = nodes[parent].firstChild;
+                nodes[parent].firstChild = next;
+                path.push_back(next);
+                return next;
+            }
+            const string& label = nodes[next].label;
+            size_t common = 0;
+            while (common < label.size() && pos + common < key.size() && label[common] == key[pos + common])
+                common++;
+            if (common < label.size()) {
+                if (!create)
+                    return -1;
+                // Splitting the label: a new node takes the shared part and adopts the old one
+                int mid = newNode(label.substr(0, common));
+                Node& old = nodes[next];
+                old.label.erase(0, common);
+                nodes[mid].firstChild = next;
+                nodes[mid].nextSibling = old.nextSibling;
+                copy(old.top, old.top + maxCompletions, nodes[mid].top);
+                nodes[mid].stale = old.stale;
+                old.nextSibling = -1;
+                int* link = &nodes[parent].firstChild;
+                while (*link != next)
+                    link = &nodes[*link].nextSibling;
+                *link = mid;
+                next = mid;
+            }
+            path.push_back(next);
+            pos += common;
+        }
+        return path.back();
+    }
+
+    // Node under which every key starting with prefix lies, or -1
+    int locate(const string& prefix) const {
+        int at = 0;
+        size_t pos = 0;
+        while (pos < prefix.size()) {
+            at = child(at, prefix[pos]);
+            if (at < 0)
+                return -1;
+            const string& label = nodes[at].label;
+            size_t n = min(label.size(), prefix.size() - pos);
+            if (label.compare(0, n, prefix, pos, n) != 0)
+                return -1;
+            pos += n;
+        }
+        return at;
+    }
+
+    bool better(int a, int b) const {
+        const Entry& x = entries[a];
+        const Entry& y = entries[b];
+        if ((x.available > 0) != (y.available > 0))
+            return x.available > 0;
+        if (x.borrows != y.borrows)
+            return x.borrows > y.borrows;
+        return x.title < y.title;
+    }
+
+    // Keeping top sorted best first; candidates already present are skipped
+    void offer(int* top, int slot) const {
+        for (size_t i = 0; i < maxCompletions; i++) {
+            if (top[i] == slot)
+                return;
+            if (top[i] < 0 || better(slot, top[i])) {
+                for (size_t j = maxCompletions - 1; j > i; j--)
+                    top[j] = top[j - 1];
+                top[i] = slot;
+                return;
+            }
+        }
+    }
+
+    void rank(int at) {
+        Node& node = nodes[at];
+        int top[maxCompletions];
+        fill(top, top + maxCompletions, -1);
+        for (int e = node.firstEntry; e >= 0; e = entries[e].nextAtNode)
+            offer(top, e);
+        for (int c = node.firstChild; c >= 0; c = nodes[c].nextSibling) {
+            for (size_t j = 0; j < maxCompletions && nodes[c].top[j] >= 0; j++)
+                offer(top, nodes[c].top[j]);
+        }
+        copy(top, top + maxCompletions, node.top);
+    }
+
+    // Marking the nodes in path stale, stopping at one already marked
+    void markStale() {
+        for (size_t i = path.size(); i-- > 0 && !nodes[path[i]].stale;)
+            nodes[path[i]].stale = true;
+    }
+
+    void rankStale(int at) {
+        if (!nodes[at].stale)
+            return;
+        for (int c = nodes[at].firstChild; c >= 0; c = nodes[c].nextSibling)
+            rankStale(c);
+        rank(at);
+        nodes[at].stale = false;
+    }
+
+    // Entry for this exact title, with path left at its node; -1 if absent
+    int findSlot(const string& title) {
+        int at = walk(TitleIndex::normalize(title), false);
+        if (at < 0)
+            return -1;
+        for (int e = nodes[at].firstEntry; e >= 0; e = entries[e].nextAtNode) {
+            if (entries[e].title == title)
+                return e;
+        }
+        return -1;
+    }
+
+public:
+    TitleCompleter() { clear(); }
+
+    void clear() {
+        nodes.clear();
+        entries.clear();
+        freeSlots.clear();
+        newNode("");
+    }
+
+    // Ranking everything changed since the last lookup, e.g. right after loading
+    void rankAll() { rankStale(0); }
+
+    // One more copy of this title
+    void add(const string& title, bool available) {
+        int node = walk(TitleIndex::normalize(title), true);
+        int slot = nodes[node].firstEntry;
+        while (slot >= 0 && entries[slot].title != title)
+            slot = entries[slot].nextAtNode;
+        if (slot < 0) {
+            Entry entry = {title, 0, 0, 0, nodes[node].firstEntry};
+            if (!freeSlots.empty()) {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+                entries[slot] = entry;
+            } else {
+                slot = (int)entries.size();
+                entries.push_back(entry);
+            }
+            nodes[node].firstEntry = slot;
+        }
+        Entry& entry = entries[slot];
+        entry.copies++;
+        if (available)
+            entry.available++;
+        else
+            entry.borrows++;
+        markStale();
+    }
+
+    // One copy of this title left the catalog; the title goes once no copies remain
+    void remove(const string& title, bool available) {
+        int slot = findSlot(title);
+        if (slot < 0)
+            return;
+        Entry& entry = entries[slot];
+        entry.copies--;
+        if (available)
+            entry.available--;
+        if (entry.copies <= 0) {
+            int* link = &nodes[path.back()].firstEntry;
+            while (*link != slot)
+                link = &entries[*link].nextAtNode;
+            *link = entry.nextAtNode;
+            freeSlots.push_back(slot);
+            entry = Entry();
+            entry.nextAtNode = -1;
+        }
+        markStale();
+    }
+
+    // A copy went out (borrowed) or came back; available is the new shelf count
+    void update(const string& title, int available, bool borrowed) {
+        int slot = findSlot(title);
+        if (slot < 0)
+            return;
+        entries[slot].available = available;
+        if (borrowed)
+            entries[slot].borrows++;
+        markStale();
+    }
+
+    vector<Completion> complete(const string& prefix, size_t k) {
+        vector<Completion> result;
+        int at = locate(TitleIndex::normalize(prefix));
+        if (at >= 0)
+            rankStale(at);
+        for (size_t i = 0; at >= 0 && i < min(k, maxCompletions) && nodes[at].top[i] >= 0; i++) {
+            const Entry& entry = entries[nodes[at].top[i]];
+            Completion completion = {entry.title, entry.available, entry.borrows};
+            result.push_back(completion);
+        }
+        return result;
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const {
+        usage.addVector(nodes);
+        for (const auto& node : nodes)
+            usage.addString(node.label);
+        usage.addVector(entries);
+        for (const auto& entry : entries)
+            usage.addString(entry.title);
+        usage.addVector(freeSlots);
+        usage.addVector(path);
+    }
+};
+
+const size_t TitleCompleter::maxCompletions;
+
+// Counting Bloom filter over strings. mayContain() answers "definitely absent" or "maybe
+// present" in constant time. Byte counters rather than bits let keys be removed again;
+// a counter that reaches 255 stays there
+class BloomFilter
+{
+private:
+    static const size_t countersPerKey = 10;    // about 1% false positives with 7 probes
+    static const size_t probeCount = 7;
+
+    vector<unsigned char> counters;
+    size_t keyCount;
+    mutable long long queries;
+    mutable long long rejected;
+    long long falsePositives;
+
+    // Double hashing: probe i lands on h1 + i * h2
+    void probes(const string& key, size_t* slots) const {
+        unsigned long long h1 = 14695981039346656037ULL;    // FNV-1a
+        for (unsigned char c : key) {
+            h1 ^= c;
+            h1 *= 1099511628211ULL;
+        }
+        unsigned long long h2 = h1;                          // murmur3 finalizer
+        h2 ^= h2 >> 33;
+        h2 *= 0xff51afd7ed558ccdULL;
+        h2 ^= h2 >> 33;
+        h2 *= 0xc4ceb9fe1a85ec53ULL;
+        h2 ^= h2 >> 33;
+        h2 |= 1;
+        for (size_t i = 0; i < probeCount; i++)
+            slots[i] = (size_t)((h1 + i * h2) % counters.size());
+    }
+
+public:
+    explicit BloomFilter(size_t expectedKeys = 0) : keyCount(0), queries(0), rejected(0), falsePositives(0) {
+        reset(expectedKeys);
+    }
+
+    // Emptying the filter and sizing it for expectedKeys; statistics are kept
+    void reset(size_t expectedKeys) {
+        counters.assign(max(expectedKeys, (size_t)64) * countersPerKey, 0);
+        keyCount = 0;
+    }
+
+    // True once more keys are stored than the filter was sized for
+    bool overloaded() const { return keyCount * countersPerKey > counters.size(); }
+
+    void add(const string& key) {
+        size_t slots[probeCount];
+        probes(key, slots);
+        for (size_t slot : slots) {
+            if (counters[slot] < 255)
+                counters[slot]++;
+        }
+        keyCount++;
+    }
+
+    void remove(const string& key) {
+        size_t slots[probeCount];
+        probes(key, slots);
+        for (size_t slot : slots) {
+            if (counters[slot] > 0 && counters[slot] < 255)
+                counters[slot]--;
+        }
+        if (keyCount > 0)
+            keyCount--;
+    }
+
+    bool mayContain(const string& key) const {
+        size_t slots[probeCount];
+        probes(key, slots);
+        queries++;
+        for (size_t slot : slots) {
+            if (counters[slot] == 0) {
+                rejected++;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Called by the owner when a "maybe" turned out to be absent after all
+    void noteFalsePositive() { falsePositives++; }
+
+    size_t memoryBytes() const { return counters.size(); }
+    size_t getKeyCount() const { return keyCount; }
+    long long getQueries() const { return queries; }
+    long long getRejected() const { return rejected; }
+    long long getFalsePositives() const { return falsePositives; }
+
+    double estimatedFalsePositiveRate() const {
+        return pow(1 - exp(-(double)probeCount * keyCount / counters.size()), (double)probeCount);
+    }
+};
+
+const size_t BloomFilter::countersPerKey;
+const size_t BloomFilter::probeCount;
+
+// Compact binary encoding of the accounts file.
+//
+//   header:  "LMSA" 0x01, base day (zigzag varint)
+//   record:  tag byte, payload length (varint), payload
+//   'A' account:      name (length-prefixed), id, role byte S/F/L, fine in paise, loan count, loans
+//   'L' loan opened:  user id, loan, fine in paise
+//   'R' loan closed:  user id, book reference, fine in paise
+//   'F' fine changed: user id, fine in paise
+//
+// A loan is a book reference followed by its borrow day relative to the base day.
+// A book reference is the book id, or 0 followed by the title for books this branch
+// doesn't hold. L/R/F records are appended after the last full write; a record cut
+// short by a crash fails its length check and is ignored.
+class AccountCodec
+{
+public:
+    static const char* magic() { return "LMSA\x01"; }
+    static const size_t headerMagicSize = 5;
+
+    static void putVarint(string& out, unsigned long long v) {
+        while (v >= 0x80) {
+            out += (char)((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+
+    static void putSigned(string& out, long long v) {
+        putVarint(out, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+    }
+
+    static void putString(string& out, const string& text) {
+        putVarint(out, text.size());
+        out += text;
+    }
+
+    static bool getVarint(const char*& p, const char* end, unsigned long long& v) {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            unsigned char byte = (unsigned char)*p++;
+            v |= (unsigned long long)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    static bool getSigned(const char*& p, const char* end, long long& v) {
+        unsigned long long raw;
+        if (!getVarint(p, end, raw))
+            return false;
+        v = (long long)(raw >> 1) ^ -(long long)(raw & 1);
+        return true;
+    }
+
+    static bool getString(const char*& p, const char* end, string& text) {
+        unsigned long long len;
+        if (!getVarint(p, end, len) || (unsigned long long)(end - p) < len)
+            return false;
+        text.assign(p, (size_t)len);
+        p += len;
+        return true;
+    }
+
+    static unsigned long long toPaise(double amount) {
+        return amount > 0 ? (unsigned long long)llround(amount * 100) : 0;
+    }
+
+    // bookId is 0 when the title has no id in this branch
+    static void putBookRef(string& out, int bookId, const string& title) {
+        putVarint(out, (unsigned long long)bookId);
+        if (bookId == 0)
+            putString(out, title);
+    }
+
+    static void putRecord(string& out, char tag, const string& payload) {
+        out += tag;
+        putVarint(out, payload.size());
+        out += payload;
+    }
+
+    static void putHeader(string& out, time_t baseDay) {
+        out.append(magic(), headerMagicSize);
+        putSigned(out, baseDay);
+    }
+
+    // Whether data starts like a compact accounts file rather than the old text format
+    static bool hasMagic(const string& data) {
+        return data.size() >= headerMagicSize && data.compare(0, headerMagicSize, magic(), headerMagicSize) == 0;
+    }
+};
+
+// Lookups from book id to catalog position and from author, publisher and year to ids.
+// Shared by a branch and its snapshots; the branch copies them before adding or removing a book
+// while a snapshot still holds them.
+struct BookIndexes
+{
+    unordered_map<int, size_t> positionById;
+    unordered_map<string, vector<int>> idsByAuthor;      // normalized author
+    unordered_map<string, vector<int>> idsByPublisher;   // normalized publisher
+    multimap<int, int> idsByYear;
+
+    void addMemoryUsage(MemoryUsage& usage) const {
+        usage.addHashMap(positionById);
+        for (const unordered_map<string, vector<int>>* index : {&idsByAuthor, &idsByPublisher}) {
+            usage.addHashMap(*index);
+            for (const auto& entry : *index) {
+                usage.addString(entry.first);
+                usage.addVector(entry.second);
+            }
+        }
+        usage.addTree(idsByYear);
+    }
+};
+
+// Immutable point-in-time view of one branch. Readers hold it through a
+// shared_ptr, so it is freed once the last report or writer using it lets go.
+// Books and users are shared with the live library, which copies a record
+// before changing it while a snapshot still points at it.
+struct LibrarySnapshot
+{
+    unsigned long long version;
+    time_t accountsBaseDay;
+    vector<shared_ptr<const Book>> books;
+    vector<Account> accounts;
+    shared_ptr<const BookIndexes> indexes;   // positions in books as of this snapshot
+
+    vector<Book> booksWithIds(const vector<int>& ids) const {
+        vector<Book> result;
+        result.reserve(ids.size());
+        for (int bookId : ids)
+            result.push_back(*books[indexes->positionById.at(bookId)]);
+        return result;
+    }
+
+    void serializeBooks(ostream& out) const {
+        for (const auto& book : books) {
+            out << book->getTitle() << "," << book->getAuthor() << "," << book->getPublisher() << ","
+                << book->getYear() << "," << book->getISBN() << "," << book->getStatus() << "," << book->getReservedBy()
+                << "," << book->getId() << "\n";
+        }
+    }
+
+    // Full compact accounts file for this snapshot
+    void encodeAccounts(string& out) const {
+        // Ids are only needed for titles on loan; the first copy of each in catalog order
+        unordered_map<string, int> idByTitle;
+        for (const auto& account : accounts) {
+            if (const BorrowerBase* borrower = account.getBorrower()) {
+                for (const auto& loan : borrower->getCurrentBooks())
+                    idByTitle.insert(make_pair(loan.first, 0));
+            }
+        }
+        if (!idByTitle.empty()) {
+            for (const auto& book : books) {
+                auto it = idByTitle.find(book->getTitle());
+                if (it != idByTitle.end() && it->second == 0)
+                    it->second = book->getId();
+            }
+        }
+
+        out.clear();
+        AccountCodec::putHeader(out, accountsBaseDay);
+        string payload;
+        for (const auto& account : accounts) {
+            if (account.getUser() == nullptr) continue;
+            const User& user = *account.getUser();
+
+            payload.clear();
+            AccountCodec::putString(payload, user.getName());
+            AccountCodec::putSigned(payload, user.getId());
+
+            const vector<pair<string, time_t>>* loans = nullptr;
+            double fine = 0;
+            if (const BorrowerBase* borrower = account.getBorrower()) {
+                payload += borrower->getRoleCode();
+                loans = &borrower->getCurrentBooks();
+                fine = borrower->getFine();
+            } else {
+                payload += 'L';
+            }
+            AccountCodec::putVarint(payload, AccountCodec::toPaise(fine));
+            AccountCodec::putVarint(payload, loans ? loans->size() : 0);
+            if (loans) {
+                for (const auto& loan : *loans) {
+                    auto it = idByTitle.find(loan.first);
+                    AccountCodec::putBookRef(payload, it == idByTitle.end() ? 0 : it->second, loan.first);
+                    AccountCodec::putSigned(payload, loan.second - accountsBaseDay);
+                }
+            }
+            AccountCodec::putRecord(out, 'A', payload);
+        }
+    }
+
+    void displayBooks() const {
+        out() << "Library Books:\n";
+        for (const auto& bk : books)
+            bk->display();
+    }
+
+    void displayAccounts() const {
+        out() << "Library Accounts:\n";
+        for (const auto& acc : accounts)
+            acc.display();
+    }
+
+    // Case-insensitive substring match on titles
+    vector<Book> searchTitles(const string& keyword) const {
+        string needle = keyword;
+        transform(needle.begin(), needle.end(), needle.begin(), ::tolower);
+        vector<Book> matches;
+        for (const auto& bk : books) {
+            string title = bk->getTitle();
+            transform(title.begin(), title.end(), title.begin(), ::tolower);
+            if (title.find(needle) != string::npos)
+                matches.push_back(*bk);
+        }
+        return matches;
+    }
+
+    // Exact author match, ignoring case and punctuation
+    vector<Book> findByAuthor(const string& author) const {
+        auto it = indexes->idsByAuthor.find(TitleIndex::normalize(author));
+        return it == indexes->idsByAuthor.end() ? vector<Book>() : booksWithIds(it->second);
+    }
+
+    // Exact publisher match, ignoring case and punctuation
+    vector<Book> findByPublisher(const string& publisher) const {
+        auto it = indexes->idsByPublisher.find(TitleIndex::normalize(publisher));
+        return it == indexes->idsByPublisher.end() ? vector<Book>() : booksWithIds(it->second);
+    }
+
+    // Books published in [fromYear, toYear], oldest first
+    vector<Book> findByYearRange(int fromYear, int toYear) const {
+        vector<int> ids;
+        const multimap<int, int>& idsByYear = indexes->idsByYear;
+        for (auto it = idsByYear.lower_bound(fromYear); it != idsByYear.end() && it->first <= toYear; ++it)
+            ids.push_back(it->second);
+        return booksWithIds(ids);
+    }
+};
+
+// Writing all of data to fd, retrying short writes and interrupts
+static bool writeAll(int fd, const string& data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Flushing a directory entry so a rename inside it survives a power loss
+static bool syncParentDirectory(const string& path)
+{
+    size_t slash = path.find_last_of('/');
+    string dir = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Writing a file via a temporary so a crash never leaves it half written.
+// The data is fsynced before the rename and the directory after it, so a true
+// return means the new contents are on disk.
+bool writeFileAtomically(const string& path, const string& data)
+{
+    string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = writeAll(fd, data) && ::fsync(fd) == 0;
+    if (::close(fd) != 0)
+        ok = false;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return syncParentDirectory(path);
+}
+
+// Background writer thread for the library files.
+// Save requests are coalesced: nothing is copied when they arrive, and the state is
+// captured once, when it is committed at most commitDelay after the first unsaved
+// change (group commit).
+class PersistenceWriter
+{
+private:
+    string booksPath;
+    string accountsPath;
+    chrono::milliseconds commitDelay;
+    recursive_mutex& stateMutex;                            // held by the library while it changes
+    function<shared_ptr<const LibrarySnapshot>()> capture;  // called with stateMutex held
+    function<void(const string&, const string&)> publish;   // change and circulation lines, once saved
+
+    mutex mtx;
+    condition_variable wakeUp;
+    condition_variable committed;
+    bool hasPending;
+    bool flushRequested;
+    bool stopping;
+    bool pendingFullAccounts;
+    string pendingAccountRecords;
+    string pendingChangeLines;      // events describing the submitted state, published after it is saved
+    string pendingCirculationLines;
+    unsigned long long submittedVersion;
+    unsigned long long committedVersion;   // last version known to be on disk
+    unsigned long long attemptedVersion;   // last version a commit was tried for
+    unsigned long long attempts;
+    size_t accountsBaseBytes;       // size of the last full accounts write
+    size_t accountsAppendedBytes;   // records appended since then
+    bool retrying;                  // the last commit failed and is still pending
+    bool accountsProtected;         // the accounts file could not be read, so it is never rewritten
+    thread worker;
+
+    static const chrono::milliseconds retryDelay;
+
+    static bool appendToFile(const string& path, const string& data) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = writeAll(fd, data) && ::fsync(fd) == 0;
+        if (::close(fd) != 0)
+            ok = false;
+        return ok;
+    }
+
+    // Straight to fd 2: cerr is tied to out(), which belongs to the session thread
+    static void reportError(const string& message) {
+        writeAll(STDERR_FILENO, message + "\n");
+    }
+
+    void run() {
+        // Events taken with a commit that has not succeeded yet; they go out with the retry
+        string changeLines, circulationLines;
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            wakeUp.wait(lock, [&] { return hasPending || stopping; });
+            if (!hasPending)
+                break;
+
+            // Letting further changes pile up until the commit window closes; after a
+            // failed commit, backing off before trying the disk again
+            auto window = retrying ? max(commitDelay, retryDelay) : commitDelay;
+            auto deadline = chrono::steady_clock::now() + window;
+            wakeUp.wait_until(lock, deadline, [&] { return flushRequested || stopping; });
+
+            // Taking the state and the records queued for it in one step with the library
+            // held still, so a record appended later is never already in a full rewrite
+            lock.unlock();
+            shared_ptr<const LibrarySnapshot> state;
+            string accountRecords;
+            bool fullAccounts;
+            bool keepAccounts;
+            unsigned long long version;
+            {
+                lock_guard<recursive_mutex> hold(stateMutex);
+                lock.lock();
+                accountRecords.swap(pendingAccountRecords);
+                changeLines += pendingChangeLines;
+                pendingChangeLines.clear();
+                circulationLines += pendingCirculationLines;
+                pendingCirculationLines.clear();
+                fullAccounts = pendingFullAccounts;
+                pendingFullAccounts = false;
+                version = submittedVersion;
+                hasPending = false;
+                keepAccounts = accountsProtected;
+                lock.unlock();
+                state = capture();
+            }
+
+            // Serializing here keeps the formatting work off the menu thread too
+            ostringstream bookData;
+            state->serializeBooks(bookData);
+            bool ok = true;
+            if (!writeFileAtomically(booksPath, bookData.str())) {
+                reportError("Error: Could not write " + booksPath);
+                ok = false;
+            }
+
+            // Appending loan records until they outgrow the compacted file, then rewriting it
+            if (!fullAccounts && accountsAppendedBytes + accountRecords.size() > max<size_t>(4096, accountsBaseBytes))
+                fullAccounts = true;
+            if (keepAccounts) {
+                // Leaving a file that could not be read for someone to repair, rather than losing its accounts
+            } else if (fullAccounts) {
+                string accountsData;
+                state->encodeAccounts(accountsData);
+                if (writeFileAtomically(accountsPath, accountsData)) {
+                    accountsBaseBytes = accountsData.size();
+                    accountsAppendedBytes = 0;
+                } else {
+                    reportError("Error: Could not write " + accountsPath);
+                    ok = false;
+                }
+            } else if (!accountRecords.empty()) {
+                if (appendToFile(accountsPath, accountRecords)) {
+                    accountsAppendedBytes += accountRecords.size();
+                } else {
+                    reportError("Error: Could not append to " + accountsPath);
+                    ok = false;
+                }
+            }
+            if (ok && (!changeLines.empty() || !circulationLines.empty())) {
+                publish(changeLines, circulationLines);
+                changeLines.clear();
+                circulationLines.clear();
+            }
+            lock.lock();
+            attempts++;
+            attemptedVersion = version;
+            if (ok) {
+                committedVersion = version;
+                retrying = false;
+            } else {
+                // Keeping the commit pending so it is retried with whatever state is current
+                // then. An append may have gone half way, so the retry rewrites the accounts in full.
+                pendingFullAccounts = true;
+                pendingAccountRecords.clear();
+                hasPending = true;
+                retrying = true;
+            }
+            committed.notify_all();
+            if (!ok && stopping) {
+                reportError("Error: Giving up on unsaved library changes");
+                break;
+            }
+        }
+    }
+
+public:
+    PersistenceWriter(const string& booksFile, const string& accountsFile, chrono::milliseconds delay,
+                      recursive_mutex& stateLock, function<shared_ptr<const LibrarySnapshot>()> captureState,
+                      function<void(const string&, const string&)> publishEvents)
+        : booksPath(booksFile), accountsPath(accountsFile), commitDelay(delay), stateMutex(stateLock),
+          capture(move(captureState)), publish(move(publishEvents)), hasPending(false),
+          flushRequested(false), stopping(false), pendingFullAccounts(false), submittedVersion(0), committedVersion(0),
+          attemptedVersion(0), attempts(0), accountsBaseBytes(0), accountsAppendedBytes(0), retrying(false),
+          accountsProtected(false) {
+        worker = thread(&PersistenceWriter::run, this);
+    }
+
+    // Noting that the state has changed and must be written; called with stateMutex held.
+    // Without fullAccounts, accountRecords are appended to the accounts file instead
+    // of rewriting it. The event lines are published once that state is on disk.
+    void submit(bool fullAccounts, const string& accountRecords, const string& changeLines,
+                const string& circulationLines) {
+        lock_guard<mutex> lock(mtx);
+        pendingChangeLines += changeLines;
+        pendingCirculationLines += circulationLines;
+        pendingFullAccounts = pendingFullAccounts || fullAccounts;
+        if (!pendingFullAccounts)
+            pendingAccountRecords += accountRecords;
+        else
+            pendingAccountRecords.clear();
+        hasPending = true;
+        submittedVersion++;
+        wakeUp.notify_all();
+    }
+
+    // Sizes of the accounts file as loaded, so records appended by earlier runs count
+    // towards the next compaction
+    void noteAccountsFile(size_t baseBytes, size_t appendedBytes) {
+        lock_guard<mutex> lock(mtx);
+        accountsBaseBytes = baseBytes;
+        accountsAppendedBytes = appendedBytes;
+    }
+
+    // Never writing the accounts file from now on; books are still saved
+    void protectAccounts() {
+        lock_guard<mutex> lock(mtx);
+        accountsProtected = true;
+    }
+
+    // Blocking until everything submitted so far is on disk, or until a fresh attempt
+    // to write it has failed; false in that case (the writer keeps retrying)
+    bool flush() {
+        unique_lock<mutex> lock(mtx);
+        unsigned long long target = submittedVersion;
+        unsigned long long startAttempts = attempts;
+        flushRequested = true;
+        wakeUp.notify_all();
+        committed.wait(lock, [&] {
+            return committedVersion >= target || (attempts != startAttempts && attemptedVersion >= target);
+        });
+        flushRequested = false;
+        return committedVersion >= target;
+    }
+
+    ~PersistenceWriter() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        worker.join();
+    }
+};
+
+const chrono::milliseconds PersistenceWriter::retryDelay(1000);
+
+// Library class
+class Library
+{
+private:
+    string branchName;
+    string booksPath;
+    string accountsPath;
+    vector<shared_ptr<Book>> books;         // shared with snapshots until a book next changes
+    vector<Account> accounts;
+    unique_ptr<PersistenceWriter> writer;
+    CirculationLog* circulation;
+    ChangeStream* changes;
+    string pendingChangeLines;              // events for the next submit, published once it is saved
+    string pendingCirculationLines;
+    TitleIndex titleIndex;
+    TitleCompleter completer;
+    unsigned long long version;
+    unsigned long long catalogVersion;      // bumped whenever a title is added or removed
+    weak_ptr<const LibrarySnapshot> published;   // reused while current and still held by someone
+    BloomFilter accountFilter;              // name and id of every account
+    unordered_map<string, size_t> accountPositions;   // accountKey -> first account with it, behind the filter
+
+    // Secondary indexes, all keyed to book ids
+    int nextBookId;
+    shared_ptr<BookIndexes> indexes;                     // shared with snapshots
+    unordered_map<string, vector<int>> idsByTitle;       // exact title
+
+    static void dropId(unordered_map<string, vector<int>>& index, const string& key, int bookId) {
+        auto it = index.find(key);
+        if (it == index.end())
+            return;
+        vector<int>& ids = it->second;
+        auto pos = find(ids.begin(), ids.end(), bookId);
+        if (pos != ids.end()) {
+            *pos = ids.back();
+            ids.pop_back();
+        }
+        if (ids.empty())
+            index.erase(it);
+    }
+
+    // The book at pos, copied first if a snapshot still holds it
+    Book& editBook(size_t pos) {
+        if (books[pos].use_count() > 1)
+            books[pos] = make_shared<Book>(*books[pos]);
+        return *books[pos];
+    }
+
+    // The indexes, copied first if a snapshot still holds them
+    BookIndexes& editIndexes() {
+        if (indexes.use_count() > 1)
+            indexes = make_shared<BookIndexes>(*indexes);
+        return *indexes;
+    }
+
+    // Giving the book at pos an id (if it has none) and adding it to every index
+    void indexBook(size_t pos) {
+        BookIndexes& idx = editIndexes();
+        if (books[pos]->getId() <= 0 || idx.positionById.count(books[pos]->getId()))
+            editBook(pos).setId(nextBookId++);
+        else
+            nextBookId = max(nextBookId, books[pos]->getId() + 1);
+        const Book& bk = *books[pos];
+        idx.positionById[bk.getId()] = pos;
+        catalogVersion++;
+        titleIndex.add(bk.getTitle());
+        completer.add(bk.getTitle(), bk.getStatus() == "Available");
+        idsByTitle[bk.getTitle()].push_back(bk.getId());
+        idx.idsByAuthor[TitleIndex::normalize(bk.getAuthor())].push_back(bk.getId());
+        idx.idsByPublisher[TitleIndex::normalize(bk.getPublisher())].push_back(bk.getId());
+        idx.idsByYear.insert(make_pair(bk.getYear(), bk.getId()));
+    }
+
+    void unindexBook(const Book& bk) {
+        BookIndexes& idx = editIndexes();
+        idx.positionById.erase(bk.getId());
+        catalogVersion++;
+        titleIndex.remove(bk.getTitle());
+        completer.remove(bk.getTitle(), bk.getStatus() == "Available");
+        dropId(idsByTitle, bk.getTitle(), bk.getId());
+        dropId(idx.idsByAuthor, TitleIndex::normalize(bk.getAuthor()), bk.getId());
+        dropId(idx.idsByPublisher, TitleIndex::normalize(bk.getPublisher()), bk.getId());
+        auto range = idx.idsByYear.equal_range(bk.getYear());
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == bk.getId()) {
+                idx.idsByYear.erase(it);
+                break;
+            }
+        }
+    }
+
+    void rebuildIndexes() {
+        titleIndex.clear();
+        completer.clear();
+        indexes = make_shared<BookIndexes>();
+        idsByTitle.clear();
+        for (size_t pos = 0; pos < books.size(); pos++)
+            indexBook(pos);
+        completer.rankAll();
+    }
+
+    static string accountKey(const string& usrName, int usrId) {
+        return usrName + '\n' + to_string(usrId);
+    }
+
+    void indexAccount(size_t pos) {
+        const User& usr = *accounts[pos].getUser();
+        accountPositions.emplace(accountKey(usr.getName(), usr.getId()), pos);
+        if (accountFilter.overloaded()) {
+            rebuildAccountFilter();
+            return;
+        }
+        accountFilter.add(accountKey(usr.getName(), usr.getId()));
+    }
+
+    // Resizing for twice the current accounts so that growth rebuilds only now and then
+    void rebuildAccountFilter() {
+        accountFilter.reset(accounts.size() * 2);
+        for (const auto& acc : accounts)
+            accountFilter.add(accountKey(acc.getUser()->getName(), acc.getUser()->getId()));
+    }
+
+    // After accounts were loaded or one was erased, which moves every later account
+    void rebuildAccountPositions() {
+        accountPositions.clear();
+        for (size_t pos = 0; pos < accounts.size(); pos++)
+            accountPositions.emplace(accountKey(accounts[pos].getUser()->getName(), accounts[pos].getUser()->getId()), pos);
+    }
+
+    // Accounts file state: base day for loan dates, and whether the file on disk
+    // already holds every account so that changes can be appended to it
+    time_t accountsBaseDay;
+    bool accountsFileCurrent;
+    bool accountsUnreadable;    // loading failed, so the file is left as it is
+
+    int bookIdForTitle(const string& title) const {
+        auto it = idsByTitle.find(title);
+        return it == idsByTitle.end() || it->second.empty() ? 0 : it->second.front();
+    }
+
+    bool ownsAccount(const Account& acc) const {
+        return !accounts.empty() && &acc >= &accounts.front() && &acc <= &accounts.back();
+    }
+
+    static double fineOf(const Account& acc) {
+        const BorrowerBase* borrower = acc.getBorrower();
+        return borrower ? borrower->getFine() : 0;
+    }
+
+    // Id of the copy Account::borrowBook or returnBook acts on: the first of that title in
+    // catalog order that satisfies pred, or 0 for none
+    template <typename Pred>
+    int firstCopyId(const string& bookTitle, Pred pred) const {
+        auto it = idsByTitle.find(bookTitle);
+        size_t first = books.size();
+        if (it != idsByTitle.end()) {
+            for (int bookId : it->second) {
+                size_t pos = indexes->positionById.at(bookId);
+                if (pos < first && pred(*books[pos]))
+                    first = pos;
+            }
+        }
+        return first < books.size() ? books[first]->getId() : 0;
+    }
+
+    // Encoded L/R/F record describing a change to one of this branch's accounts
+    string accountRecord(char tag, const Account& acc, const string& title, time_t day) const {
+        string payload;
+        AccountCodec::putSigned(payload, acc.getUser()->getId());
+        if (tag == 'L' || tag == 'R')
+            AccountCodec::putBookRef(payload, bookIdForTitle(title), title);
+        if (tag == 'L')
+            AccountCodec::putSigned(payload, day - accountsBaseDay);
+        AccountCodec::putVarint(payload, AccountCodec::toPaise(fineOf(acc)));
+        string record;
+        AccountCodec::putRecord(record, tag, payload);
+        return record;
+    }
+
+    void submitState(bool fullAccounts, const string& accountRecords) {
+        version++;
+        string changeLines, circulationLines;
+        changeLines.swap(pendingChangeLines);
+        circulationLines.swap(pendingCirculationLines);
+        if (!writer) {
+            // Nothing is saved for an in-memory branch, so there is nothing to wait for
+            publishEvents(changeLines, circulationLines);
+            return;
+        }
+        try {
+            bool full = fullAccounts || !accountsFileCurrent;
+            accountsFileCurrent = true;
+            writer->submit(full, accountRecords, changeLines, circulationLines);
+        } catch (const exception& e) {
+            cerr << "Error queuing library state: " << e.what() << endl;
+        }
+    }
+
+    // Called by the writer thread after a commit; the logs are attached before any submit
+    void publishEvents(const string& changeLines, const string& circulationLines) {
+        if (changes && !changeLines.empty())
+            changes->publish(changeLines);
+        if (circulation && !circulationLines.empty())
+            circulation->publish(circulationLines);
+    }
+
+    // accounts.dat -> accounts.txt, the text format used before the compact one
+    string legacyAccountsPath() const {
+        const string ext = ".dat";
+        if (accountsPath.size() <= ext.size() || accountsPath.compare(accountsPath.size() - ext.size(), ext.size(), ext) != 0)
+            return "";
+        return accountsPath.substr(0, accountsPath.size() - ext.size()) + ".txt";
+    }
+
+    // Returns the bytes of L/R/F records appended after the account records; complete is
+    // false when the file ends in a record cut off part way
+    size_t loadCompactAccounts(const string& data, bool& complete) {
+        if (!AccountCodec::hasMagic(data))
+            throw runtime_error("not a compact accounts file");
+        const char* p = data.data() + AccountCodec::headerMagicSize;
+        const char* end = data.data() + data.size();
+        long long baseDay;
+        if (!AccountCodec::getSigned(p, end, baseDay))
+            throw runtime_error("truncated accounts header");
+        accountsBaseDay = (time_t)baseDay;
+
+        unordered_map<int, string> titleById;
+        for (const auto& bk : books)
+            titleById[bk->getId()] = bk->getTitle();
+        unordered_map<long long, size_t> accountById;
+
+        // Title of a book reference; empty when the id is no longer in the catalog
+        auto readBookRef = [&](const char*& q, const char* e, string& title) {
+            unsigned long long bookId;
+            if (!AccountCodec::getVarint(q, e, bookId))
+                return false;
+            if (bookId == 0)
+                return AccountCodec::getString(q, e, title);
+            auto it = titleById.find((int)bookId);
+            title = it == titleById.end() ? string() : it->second;
+            return true;
+        };
+
+        size_t unreadable = 0;
+        size_t appendedBytes = 0;
+        complete = true;
+        while (p < end) {
+            const char* recordStart = p;
+            char tag = *p++;
+            unsigned long long len;
+            if (!AccountCodec::getVarint(p, end, len) || (unsigned long long)(end - p) < len) {
+                cerr << "Ignoring a truncated record at the end of " << accountsPath << endl;
+                complete = false;
+                break;
+            }
+            const char* q = p;
+            const char* recordEnd = p + len;
+            p = recordEnd;
+            if (tag != 'A')
+                appendedBytes += recordEnd - recordStart;
+
+            long long userId;
+            unsigned long long finePaise = 0;
+            string title;
+            bool ok = true;
+            if (tag == 'A') {
+                string name;
+                unsigned long long loanCount;
+                ok = AccountCodec::getString(q, recordEnd, name) && AccountCodec::getSigned(q, recordEnd, userId) &&
+                     q < recordEnd;
+                char role = ok ? *q++ : 0;
+                ok = ok && AccountCodec::getVarint(q, recordEnd, finePaise) && AccountCodec::getVarint(q, recordEnd, loanCount);
+                if (!ok) {
+                    unreadable++;
+                    continue;
+                }
+
+                shared_ptr<User> newUser;
+                if (const BorrowerRole* borrowerRole = findBorrowerRole(role)) {
+                    shared_ptr<BorrowerBase> borrower = borrowerRole->create(name, (int)userId);
+                    newUser = borrower;
+                    for (unsigned long long i = 0; i < loanCount && ok; i++) {
+                        long long offset;
+                        ok = readBookRef(q, recordEnd, title) && AccountCodec::getSigned(q, recordEnd, offset);
+                        if (ok && !title.empty())
+                            borrower->restoreLoan(title, accountsBaseDay + offset);
+                    }
+                    if (borrower->chargesFines())
+                        borrower->setFine(finePaise / 100.0);
+                } else if (role == 'L') {
+                    newUser = make_shared<Librarian>(name, (int)userId);
+                }
+                if (!ok || !newUser) {
+                    unreadable++;
+                    continue;
+                }
+                accountById[userId] = accounts.size();
+                accounts.push_back(Account(newUser));
+                continue;
+            }
+
+            ok = AccountCodec::getSigned(q, recordEnd, userId);
+            auto found = ok ? accountById.find(userId) : accountById.end();
+            if (found == accountById.end()) {
+                unreadable++;
+                continue;
+            }
+            Account& acc = accounts[found->second];
+            long long offset = 0;
+            if (tag == 'L')
+                ok = readBookRef(q, recordEnd, title) && AccountCodec::getSigned(q, recordEnd, offset);
+            else if (tag == 'R')
+                ok = readBookRef(q, recordEnd, title);
+            else if (tag != 'F')
+                ok = false;
+            ok = ok && AccountCodec::getVarint(q, recordEnd, finePaise);
+            if (!ok) {
+                unreadable++;
+                continue;
+            }
+
+            if (tag == 'L' && !title.empty())
+                acc.restoreLoan(title, accountsBaseDay + offset);
+            else if (tag == 'R' && !title.empty())
+                acc.dropLoan(title);
+            acc.restoreFine(finePaise / 100.0);
+        }
+        if (unreadable > 0)
+            cerr << "Skipped " << unreadable << " unreadable records in " << accountsPath << endl;
+        return appendedBytes;
+    }
+
+    // Reading the old "name,id,role,title:day,...,fine" text format
+    void loadLegacyAccounts(istream& accountFile) {
+        string accountLine;
+        while (getline(accountFile, accountLine)) {
+            stringstream ss(accountLine);
+            string name, idStr, role, bookStr, fineStr;
+            getline(ss, name, ',');
+            getline(ss, idStr, ',');
+            getline(ss, role, ',');
+
+            int id = stoi(idStr);
+            shared_ptr<User> newUser;
+
+            if (const BorrowerRole* borrowerRole = findBorrowerRole(role)) {
+                shared_ptr<BorrowerBase> borrower = borrowerRole->create(name, id);
+                while (getline(ss, bookStr, ',') && !bookStr.empty() && bookStr.find(':') != string::npos) {
+                    stringstream bookSS(bookStr);
+                    string bookTitle;
+                    time_t borrowDate;
+                    getline(bookSS, bookTitle, ':');
+                    bookSS >> borrowDate;
+                    borrower->restoreLoan(bookTitle, borrowDate);
+                }
+                
+                // Roles with fines end the line with the fine
+                if (borrower->chargesFines()) {
+                    if (!bookStr.empty() && bookStr.find(':') == string::npos) {
+                        fineStr = bookStr;
+                    } else if (getline(ss, fineStr, ',')) {
+                        // Here we are extracting the fine if there's still more to read
+                    }
+                
+                    try {
+                        if (!fineStr.empty()) {
+                            borrower->setFine(stod(fineStr));
+                        }
+                    } catch (const exception& e) {
+                        cerr << "Error parsing fine: " << e.what() << " for " << name << endl;
+                        borrower->setFine(0);
                     }
-                    
-                    Account newAccount(newUser);
-                    library.addAccount(std::move(newAccount), *librarian);
-                    library.saveState();
-                } 
-                else if (librarianChoice == 4) 
-                {
-                    string userName;
-                    cout << "Enter the user name to remove: ";
-                    cin.ignore();
-                    getline(cin, userName);
-                    
-                    library.removeAccount(userName, *librarian);
-                    library.saveState();
-                } 
-                else if (librarianChoice == 5) 
-                {
-                    library.displayBooks();
-                } 
-                else if (librarianChoice == 6) 
-                {
-                    library.displayAccounts();
-                } 
-                else 
-                {
-                    cout << "Invalid choice. Please try again." << endl;
                 }
+                newUser = borrower;
+            } else if (role == "Librarian") {
+                newUser = make_shared<Librarian>(name, id);
+            }
+
+            if (newUser) {
+                accounts.push_back(Account(newUser));
+            }
+        }
+    }
+
+    string authorOf(const string& bookTitle) const {
+        int bookId = bookIdForTitle(bookTitle);
+        return bookId ? books[indexes->positionById.at(bookId)]->getAuthor() : "";
+    }
+
+    int availableCopies(const string& bookTitle) const {
+        int count = 0;
+        auto it = idsByTitle.find(bookTitle);
+        if (it != idsByTitle.end()) {
+            for (int bookId : it->second)
+                count += books[indexes->positionById.at(bookId)]->getStatus() == "Available";
+        }
+        return count;
+    }
+
+    // Whether any copy of this title satisfies pred; titles not held here fail at once
+    template <typename Pred>
+    bool anyCopy(const string& bookTitle, Pred pred) const {
+        auto it = idsByTitle.find(bookTitle);
+        if (it == idsByTitle.end())
+            return false;
+        for (int bookId : it->second) {
+            if (pred(*books[indexes->positionById.at(bookId)]))
+                return true;
+        }
+        return false;
+    }
+
+public:
+    // Held while any branch changes and while a snapshot is taken. One lock covers every
+    // branch, since borrowing from another branch changes an account of the home branch.
+    static recursive_mutex stateMutex;
+
+    // Empty file names give an in-memory branch that is never saved
+    Library(const string& name, const string& booksFile, const string& accountsFile)
+        : branchName(name), booksPath(booksFile), accountsPath(accountsFile),
+          circulation(nullptr), changes(nullptr), version(0), catalogVersion(0), nextBookId(1),
+          indexes(make_shared<BookIndexes>()), accountsBaseDay(0),
+          accountsFileCurrent(false), accountsUnreadable(false) {
+        if (!booksFile.empty())
+            writer.reset(new PersistenceWriter(booksFile, accountsFile, chrono::milliseconds(100), stateMutex,
+                                               [this] { return snapshot(); },
+                                               [this](const string& changeLines, const string& circulationLines) {
+                                                   publishEvents(changeLines, circulationLines);
+                                               }));
+    }
+
+    // Stopping the writer first, while everything its last commit reads is still here
+    ~Library() { writer.reset(); }
+
+    const string& getBranchName() const { return branchName; }
+
+    // Circulation events are reported to this log from now on
+    void attachCirculationLog(CirculationLog* log) { circulation = log; }
+
+    // Every change to this branch is published to this stream from now on
+    void attachChangeStream(ChangeStream* stream) { changes = stream; }
+
+    bool borrowBook(Account& acc, const string& bookTitle, time_t day) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        if (!idsByTitle.count(bookTitle)) {
+            out() << "The book '" << bookTitle << "' is not available.\n";
+            return false;
+        }
+        int copyId = firstCopyId(bookTitle, [](const Book& bk) { return bk.getStatus() == "Available"; });
+        bool success = acc.borrowBook(bookTitle, day, copyId ? &editBook(indexes->positionById.at(copyId)) : nullptr);
+        if (success) {
+            completer.update(bookTitle, availableCopies(bookTitle), true);
+            if (circulation)
+                pendingCirculationLines += circulation->recordBorrow(day, *acc.getBorrower(), bookTitle, authorOf(bookTitle));
+            if (changes)
+                pendingChangeLines += changes->loanOpened(day, branchName, *acc.getUser(), copyId, bookTitle, fineOf(acc));
+            if (ownsAccount(acc))
+                noteAccountChange('L', acc, bookTitle, day);
+            else
+                markDirty(string());
+        }
+        return success;
+    }
+
+    bool returnBook(Account& acc, const string& bookTitle, time_t day) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        // The copy this user holds, not just any copy of the title
+        const string& borrowerName = acc.getUser()->getName();
+        int copyId = firstCopyId(bookTitle, [&](const Book& bk) {
+            return bk.getStatus() == "Borrowed" && bk.getReservedBy() == borrowerName;
+        });
+        bool success = acc.returnBook(bookTitle, day, copyId ? &editBook(indexes->positionById.at(copyId)) : nullptr);
+        if (success) {
+            completer.update(bookTitle, availableCopies(bookTitle), false);
+            if (circulation)
+                pendingCirculationLines += circulation->recordReturn(day, *acc.getBorrower(), bookTitle, authorOf(bookTitle));
+            if (changes)
+                pendingChangeLines += changes->loanClosed(day, branchName, *acc.getUser(), copyId, bookTitle, fineOf(acc));
+            if (ownsAccount(acc))
+                noteAccountChange('R', acc, bookTitle, day);
+            else
+                markDirty(string());
+        }
+        return success;
+    }
+
+    void payFine(Account& acc, time_t day) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        double paid = acc.payFine(day);
+        if (paid > 0) {
+            if (circulation)
+                pendingCirculationLines += circulation->recordFinePaid(day, *acc.getBorrower(), paid);
+            if (changes)
+                pendingChangeLines += changes->finePaid(day, branchName, *acc.getUser(), paid, fineOf(acc));
+            noteAccountChange('F', acc, "", day);
+        }
+    }
+
+    void addBook(const Book& bk, const Librarian& lib) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        books.push_back(make_shared<Book>(bk));
+        books.back()->setId(0);
+        indexBook(books.size() - 1);
+        if (changes)
+            pendingChangeLines += changes->bookAdded(getCurrentDate(), branchName, *books.back());
+        out() << "Librarian " << lib.getName() << " just tossed in '" << bk.getTitle() << "'.\n";
+        markDirty(string());
+    }
+    
+    void removeBook(const string& booTitle, const Librarian& lib) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        string target = booTitle;
+        vector<string> sameTitle = titleIndex.exactMatches(booTitle);
+        if (sameTitle.size() == 1)
+            target = sameTitle.front();
+        auto it = books.end();
+        if (idsByTitle.count(target)) {
+            it = find_if(books.begin(), books.end(), [&](const shared_ptr<Book>& bk) {
+                return bk->getTitle() == target;
+            });
+        }
+        if (it != books.end()) {
+            if (changes)
+                pendingChangeLines += changes->bookRemoved(getCurrentDate(), branchName, **it);
+            unindexBook(**it);
+            size_t pos = it - books.begin();
+            books.erase(it);
+            BookIndexes& idx = editIndexes();
+            for (; pos < books.size(); pos++)
+                idx.positionById[books[pos]->getId()] = pos;
+            out() << "Librarian " << lib.getName() << " booted out '" << target << "'.\n";
+            // Full rewrite, since appended loan records may refer to the removed book's id
+            markDirty();
+        } else {
+            out() << "Oops, '" << booTitle << "' couldn't be found.\n";
+            for (const auto& match : titleIndex.suggest(booTitle, 3))
+                out() << "Did you mean '" << match.second << "'?\n";
+        }
+    }
+    
+    void addAccount(Account acc, const Librarian& lib) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        out() << "Librarian " << lib.getName() << " added account for " << acc.getUser()->getName() << ".\n";
+        accounts.push_back(std::move(acc));
+        indexAccount(accounts.size() - 1);
+        if (changes)
+            pendingChangeLines += changes->accountAdded(getCurrentDate(), branchName, *accounts.back().getUser());
+        markDirty();
+    }
+
+    // The Admin librarian, for a library that has no way to log in otherwise
+    void addDefaultLibrarian() {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        accounts.push_back(Account(make_shared<Librarian>("Admin", 1)));
+        indexAccount(accounts.size() - 1);
+        if (changes)
+            pendingChangeLines += changes->accountAdded(getCurrentDate(), branchName, *accounts.back().getUser());
+        markDirty();
+    }
+    
+    void removeAccount(const string& usrName, const Librarian& lib) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        auto it = find_if(accounts.begin(), accounts.end(), [&](const Account& acc) {
+            return acc.getUser()->getName() == usrName;
+        });
+        if (it != accounts.end()) {
+            accountFilter.remove(accountKey(it->getUser()->getName(), it->getUser()->getId()));
+            if (changes)
+                pendingChangeLines += changes->accountRemoved(getCurrentDate(), branchName, *it->getUser());
+            accounts.erase(it);
+            rebuildAccountPositions();
+            out() << "Librarian " << lib.getName() << " axed account for " << usrName << ".\n";
+            markDirty();
+        } else {
+            out() << "Account for " << usrName << " not found.\n";
+        }
+    }
+    
+    // Copy-on-write view of the current state, readable from any thread while borrowing
+    // and returning carry on. It shares every book and user with the live branch, so
+    // taking one costs a pointer per record; it is only taken when a reader or the
+    // background writer asks for one.
+    shared_ptr<const LibrarySnapshot> snapshot() {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        shared_ptr<const LibrarySnapshot> current = published.lock();
+        if (!current || current->version != version) {
+            shared_ptr<LibrarySnapshot> fresh = make_shared<LibrarySnapshot>();
+            fresh->version = version;
+            fresh->accountsBaseDay = accountsBaseDay;
+            fresh->books.assign(books.begin(), books.end());
+            fresh->accounts = accounts;
+            fresh->indexes = indexes;
+            published = fresh;
+            current = fresh;
+        }
+        return current;
+    }
+
+    void displayBooks() {
+        snapshot()->displayBooks();
+    }
+
+    void displayAccounts() {
+        snapshot()->displayAccounts();
+    }
+    
+    const vector<Account>& getAccounts() const { return accounts; }
+
+    Account* findAccount(const string& usrName, int usrId) {
+        string key = accountKey(usrName, usrId);
+        if (!accountFilter.mayContain(key))
+            return nullptr;
+        auto found = accountPositions.find(key);
+        if (found != accountPositions.end())
+            return &accounts[found->second];
+        accountFilter.noteFalsePositive();
+        return nullptr;
+    }
+
+    const BloomFilter& getAccountFilter() const { return accountFilter; }
+
+    // Walking every structure of this branch, adding its heap use to the report
+    void addMemoryUsage(MemoryReport& report) const {
+        report.bookCount += books.size();
+        report.accountCount += accounts.size();
+
+        report.books.addVector(books);
+        for (const auto& bk : books) {
+            report.books.addShared(sizeof(Book));
+            bk->addMemoryUsage(report.books);
+        }
+
+        report.bookIndexes.addShared(sizeof(BookIndexes));
+        indexes->addMemoryUsage(report.bookIndexes);
+        report.bookIndexes.addHashMap(idsByTitle);
+        for (const auto& entry : idsByTitle) {
+            report.bookIndexes.addString(entry.first);
+            report.bookIndexes.addVector(entry.second);
+        }
+        titleIndex.addMemoryUsage(report.titleIndex);
+        completer.addMemoryUsage(report.completer);
+
+        report.accounts.addVector(accounts);
+        for (const auto& acc : accounts)
+            acc.addMemoryUsage(report.users, report.loans);
+        report.accountFilter.addBlocks(1, accountFilter.memoryBytes());
+        report.accountFilter.addHashMap(accountPositions);
+        for (const auto& entry : accountPositions)
+            report.accountFilter.addString(entry.first);
+
+        // Only the records a snapshot no longer shares with the live branch are its own
+        if (shared_ptr<const LibrarySnapshot> current = published.lock()) {
+            MemoryUsage& copy = report.snapshots;
+            copy.addShared(sizeof(LibrarySnapshot));
+            copy.addVector(current->books);
+            for (size_t i = 0; i < current->books.size(); i++) {
+                const Book& bk = *current->books[i];
+                auto live = indexes->positionById.find(bk.getId());
+                if (live == indexes->positionById.end() || books[live->second].get() != &bk) {
+                    copy.addShared(sizeof(Book));
+                    bk.addMemoryUsage(copy);
+                }
+            }
+            if (current->indexes != indexes) {
+                copy.addShared(sizeof(BookIndexes));
+                current->indexes->addMemoryUsage(copy);
+            }
+            copy.addVector(current->accounts);
+            for (size_t i = 0; i < current->accounts.size(); i++) {
+                const Account& acc = current->accounts[i];
+                if (i >= accounts.size() || accounts[i].getUser() != acc.getUser())
+                    acc.addMemoryUsage(copy, copy);
+            }
+        }
+    }
+    unsigned long long getCatalogVersion() const { return catalogVersion; }
+
+    const TitleIndex& getTitleIndex() const { return titleIndex; }
+    TitleCompleter& getTitleCompleter() { return completer; }
+
+    bool hasAvailableCopy(const string& bookTitle) const {
+        return anyCopy(bookTitle, [](const Book& bk) { return bk.getStatus() == "Available"; });
+    }
+
+    bool hasCopyBorrowedBy(const string& bookTitle, const string& usrName) const {
+        return anyCopy(bookTitle, [&](const Book& bk) {
+            return bk.getStatus() == "Borrowed" && bk.getReservedBy() == usrName;
+        });
+    }
+    
+    // Loading the library state from files
+    void loadState() 
+    {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        try {
+            ifstream bookFile(booksPath);
+            if (bookFile.is_open()) {
+                string line;
+                while (getline(bookFile, line)) {
+                    stringstream ss(line);
+                    string title, author, publisher, yearStr, ISBN, status, reservedBy, idStr;
+                    getline(ss, title, ',');
+                    getline(ss, author, ',');
+                    getline(ss, publisher, ',');
+                    getline(ss, yearStr, ',');
+                    getline(ss, ISBN, ',');
+                    getline(ss, status, ',');
+                    getline(ss, reservedBy, ',');
+                    getline(ss, idStr, ',');
+
+                    Book book(title, author, publisher, stoi(yearStr), ISBN);
+                    book.setStatus(status);
+                    book.setReservedBy(reservedBy);
+                    if (!idStr.empty())
+                        book.setId(stoi(idStr));
+                    books.push_back(make_shared<Book>(move(book)));
+                }
+                bookFile.close();
+                rebuildIndexes();
+                out() << "Books loaded successfully.\n";
+            } else {
+                out() << "No existing books file found. Starting with empty library.\n";
+            }
+        } catch (const exception& e) {
+            cerr << "Error loading books: " << e.what() << endl;
+        }
+
+        try {
+            accountsBaseDay = getCurrentDate();
+            ifstream accountFile(accountsPath, ios::binary);
+            string legacyPath = legacyAccountsPath();
+            ifstream legacyFile;
+            if (!accountFile.is_open() && !legacyPath.empty())
+                legacyFile.open(legacyPath);
+
+            if (accountFile.is_open()) {
+                // One read of the whole file, then decoding straight from memory
+                accountFile.seekg(0, ios::end);
+                string data((size_t)accountFile.tellg(), '\0');
+                accountFile.seekg(0, ios::beg);
+                accountFile.read(&data[0], data.size());
+                accountFile.close();
+                if (AccountCodec::hasMagic(data)) {
+                    bool complete;
+                    size_t appendedBytes = loadCompactAccounts(data, complete);
+                    // Records appended after a cut-off one would be misread, so that file is rewritten first
+                    accountsFileCurrent = complete;
+                    if (writer)
+                        writer->noteAccountsFile(data.size() - appendedBytes, appendedBytes);
+                    out() << "Accounts loaded successfully.\n";
+                } else {
+                    // Any file without the compact header is taken to be in the old text format
+                    istringstream text(data);
+                    loadLegacyAccounts(text);
+                    out() << "Accounts loaded successfully from the text format; " << accountsPath
+                         << " will be saved in the compact format from now on.\n";
+                }
+            } else if (legacyFile.is_open()) {
+                loadLegacyAccounts(legacyFile);
+                out() << "Accounts loaded successfully from " << legacyPath << "; they will be saved to "
+                     << accountsPath << " from now on.\n";
+            } else {
+                out() << "No existing accounts file found. Starting with empty accounts.\n";
+            }
+        } catch (const exception& e) {
+            // Saving now would replace the file with only the accounts read so far
+            cerr << "Error loading accounts: " << e.what() << endl;
+            accountsUnreadable = true;
+            if (writer) {
+                writer->protectAccounts();
+                cerr << "Account changes will not be saved, so that " << accountsPath << " can be repaired." << endl;
+            }
+        }
+        rebuildAccountFilter();
+        rebuildAccountPositions();
+    }
+
+    // Telling the background writer the state has changed; returns without touching the disk
+    void markDirty() {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        submitState(true, string());
+    }
+
+    // Same, for changes that leave this branch's accounts as they are apart from the given
+    // appended records (empty when no account here changed)
+    void markDirty(const string& accountRecords) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        submitState(false, accountRecords);
+    }
+
+    // Recording a loan opened ('L') or closed ('R') or a fine change ('F') for one of this
+    // branch's accounts, made while the book itself may belong to another branch
+    void noteAccountChange(char tag, const Account& acc, const string& title, time_t day) {
+        lock_guard<recursive_mutex> hold(stateMutex);
+        markDirty(writer ? accountRecord(tag, acc, title, day) : string());
+    }
+
+    // Saving the library state to files and waiting until it is on disk. The state lock
+    // is not held while waiting, since the writer needs it to take the state.
+    void saveState() {
+        markDirty(string());
+        if (!writer)
+            return;
+        if (writer->flush()) {
+            out() << "Books saved successfully.\n";
+            if (accountsUnreadable)
+                cerr << "Accounts not saved: " << accountsPath << " could not be read at startup." << endl;
+            else
+                out() << "Accounts saved successfully.\n";
+        } else {
+            cerr << "Error saving library state." << endl;
+        }
+    }
+};
+
+recursive_mutex Library::stateMutex;
+
+// Routes requests to the branch (shard) that owns the book or account.
+// Each branch has its own books/accounts files and background writer.
+class LibraryRouter
+{
+private:
+    vector<unique_ptr<Library>> branches;
+    CirculationLog* circulation;    // handed to every branch, including ones added later
+    ChangeStream* changes;
+
+    void adopt(Library* branch) {
+        branch->attachCirculationLog(circulation);
+        branch->attachChangeStream(changes);
+        branches.emplace_back(branch);
+    }
+
+    // "Did you mean" answers for recently mistyped titles, dropped whenever a catalog changes
+    unordered_map<string, vector<string>> suggestionCache;
+    unsigned long long suggestionCacheVersion;      // sum of the branches' catalog versions
+
+    unsigned long long catalogVersions() const {
+        unsigned long long total = 0;
+        for (const auto& branch : branches)
+            total += branch->getCatalogVersion();
+        return total;
+    }
+
+public:
+    LibraryRouter() : circulation(nullptr), changes(nullptr), suggestionCacheVersion(0) {}
+
+    // Reading "name,booksFile,accountsFile" lines; without a config a single
+    // Main branch uses books.txt and accounts.dat
+    void loadBranches(const string& configPath) {
+        ifstream config(configPath);
+        string line;
+        while (getline(config, line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            stringstream ss(line);
+            string name, booksFile, accountsFile;
+            getline(ss, name, ',');
+            getline(ss, booksFile, ',');
+            getline(ss, accountsFile, ',');
+            if (name.empty() || booksFile.empty() || accountsFile.empty()) {
+                cerr << "Skipping malformed branch entry: " << line << endl;
+                continue;
+            }
+            adopt(new Library(name, booksFile, accountsFile));
+        }
+        if (branches.empty())
+            adopt(new Library("Main", "books.txt", "accounts.dat"));
+
+        for (auto& branch : branches) {
+            if (branches.size() > 1)
+                out() << "Loading " << branch->getBranchName() << " branch...\n";
+            branch->loadState();
+        }
+
+        // Creating a default librarian account if there are no accounts anywhere
+        bool anyAccounts = false;
+        for (const auto& branch : branches)
+            anyAccounts = anyAccounts || !branch->getAccounts().empty();
+        if (!anyAccounts) {
+            branches.front()->addDefaultLibrarian();
+            out() << "Created default librarian account (Name: Admin, ID: 1)\n";
+        }
+    }
+
+    // Takes ownership of an already loaded branch
+    void addBranch(Library* branch) { adopt(branch); }
+
+    size_t branchCount() const { return branches.size(); }
+
+    MemoryReport memoryReport() const {
+        MemoryReport report;
+        for (const auto& branch : branches)
+            branch->addMemoryUsage(report);
+        return report;
+    }
+    Library& getBranch(size_t idx) { return *branches[idx]; }
+
+    void attachCirculationLog(CirculationLog* log) {
+        circulation = log;
+        for (auto& branch : branches)
+            branch->attachCirculationLog(log);
+    }
+
+    void attachChangeStream(ChangeStream* stream) {
+        changes = stream;
+        for (auto& branch : branches)
+            branch->attachChangeStream(stream);
+    }
+
+    // Finding an account in any branch; home is set to the branch holding it
+    Account* findAccount(const string& usrName, int usrId, Library*& home) {
+        for (auto& branch : branches) {
+            Account* acc = branch->findAccount(usrName, usrId);
+            if (acc) {
+                home = branch.get();
+                return acc;
+            }
+        }
+        return nullptr;
+    }
+
+    // Mapping a typed title to its catalog spelling when it only differs in case or punctuation
+    string resolveTitle(const string& typed) const {
+        vector<string> spellings;
+        for (const auto& branch : branches) {
+            for (const auto& title : branch->getTitleIndex().exactMatches(typed)) {
+                if (title == typed)
+                    return typed;
+                if (find(spellings.begin(), spellings.end(), title) == spellings.end())
+                    spellings.push_back(title);
+            }
+        }
+        return spellings.size() == 1 ? spellings.front() : typed;
+    }
+
+    bool isKnownTitle(const string& typed) const {
+        for (const auto& branch : branches) {
+            if (!branch->getTitleIndex().exactMatches(typed).empty())
+                return true;
+        }
+        return false;
+    }
+
+    // Best completions of a typed prefix over all branches; copies of one title held by
+    // several branches are added together
+    vector<TitleCompleter::Completion> completeTitle(const string& prefix, size_t k) {
+        vector<TitleCompleter::Completion> merged;
+        for (const auto& branch : branches) {
+            for (const auto& completion : branch->getTitleCompleter().complete(prefix, k)) {
+                auto same = find_if(merged.begin(), merged.end(), [&](const TitleCompleter::Completion& c) {
+                    return c.title == completion.title;
+                });
+                if (same == merged.end()) {
+                    merged.push_back(completion);
+                } else {
+                    same->available += completion.available;
+                    same->borrows += completion.borrows;
+                }
+            }
+        }
+        if (branches.size() > 1) {
+            sort(merged.begin(), merged.end(), [](const TitleCompleter::Completion& a, const TitleCompleter::Completion& b) {
+                if ((a.available > 0) != (b.available > 0))
+                    return a.available > 0;
+                if (a.borrows != b.borrows)
+                    return a.borrows > b.borrows;
+                return a.title < b.title;
+            });
+        }
+        if (merged.size() > k)
+            merged.resize(k);
+        return merged;
+    }
+
+    void suggestTitles(const string& typed) {
+        unsigned long long current = catalogVersions();
+        if (current != suggestionCacheVersion || suggestionCache.size() >= 1024) {
+            suggestionCache.clear();
+            suggestionCacheVersion = current;
+        }
+        auto cached = suggestionCache.find(typed);
+        if (cached == suggestionCache.end())
+            cached = suggestionCache.insert(make_pair(typed, rankSuggestions(typed))).first;
+        for (const auto& title : cached->second)
+            out() << "Did you mean '" << title << "'?\n";
+    }
+
+    // Up to three closest titles over all branches
+    vector<string> rankSuggestions(const string& typed) const {
+        vector<pair<size_t, string>> merged;
+        for (const auto& branch : branches) {
+            for (const auto& match : branch->getTitleIndex().suggest(typed, 3)) {
+                bool seen = false;
+                for (const auto& m : merged)
+                    seen = seen || m.second == match.second;
+                if (!seen)
+                    merged.push_back(match);
+            }
+        }
+        sort(merged.begin(), merged.end());
+        vector<string> titles;
+        for (size_t i = 0; i < merged.size() && i < 3; i++)
+            titles.push_back(merged[i].second);
+        return titles;
+    }
+
+    // Borrowing from the home branch if it has a copy, otherwise from any branch that does
+    bool borrowBook(Library& home, Account& acc, const string& typedTitle, time_t day) {
+        string bookTitle = resolveTitle(typedTitle);
+        if (bookTitle != typedTitle)
+            out() << "Matched '" << bookTitle << "'.\n";
+
+        Library* source = &home;
+        if (!home.hasAvailableCopy(bookTitle)) {
+            for (auto& branch : branches) {
+                if (branch->hasAvailableCopy(bookTitle)) {
+                    source = branch.get();
+                    break;
+                }
+            }
+        }
+        bool success = source->borrowBook(acc, bookTitle, day);
+        if (success && source != &home) {
+            home.noteAccountChange('L', acc, bookTitle, day);
+            out() << "Borrowed from the " << source->getBranchName() << " branch.\n";
+        }
+        // Only a title no branch holds gets suggestions; a known one failed for another reason
+        if (!success && !isKnownTitle(typedTitle))
+            suggestTitles(typedTitle);
+        return success;
+    }
+
+    // Returning the copy to the branch it was borrowed from
+    bool returnBook(Library& home, Account& acc, const string& typedTitle, time_t day) {
+        // Matching against the user's own loans, ignoring case and punctuation
+        string bookTitle = typedTitle;
+        string wanted = TitleIndex::normalize(typedTitle);
+        for (const auto& title : acc.getBorrowedBooks()) {
+            if (title == typedTitle) {
+                bookTitle = title;
+                break;
+            }
+            if (TitleIndex::normalize(title) == wanted)
+                bookTitle = title;
+        }
+
+        Library* owner = &home;
+        if (!home.hasCopyBorrowedBy(bookTitle, acc.getUser()->getName())) {
+            for (auto& branch : branches) {
+                if (branch->hasCopyBorrowedBy(bookTitle, acc.getUser()->getName())) {
+                    owner = branch.get();
+                    break;
+                }
+            }
+        }
+        bool success = owner->returnBook(acc, bookTitle, day);
+        if (success && owner != &home)
+            home.noteAccountChange('R', acc, bookTitle, day);
+        return success;
+    }
+
+    // Gathering the per-branch results of a scatter-gather query, in branch order
+    void printMatches(vector<future<vector<Book>>>& pending, const string& description) const {
+        size_t found = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            vector<Book> matches = pending[i].get();
+            for (const auto& bk : matches) {
+                if (branches.size() > 1)
+                    out() << "[" << branches[i]->getBranchName() << "] ";
+                bk.display();
+            }
+            found += matches.size();
+        }
+        if (found == 0)
+            out() << "No books " << description << " were found.\n";
+    }
+
+    // Scatter-gather title search: every branch is searched in parallel
+    void searchTitles(const string& keyword) {
+        vector<future<vector<Book>>> pending;
+        for (const auto& branch : branches) {
+            shared_ptr<const LibrarySnapshot> shard = branch->snapshot();
+            pending.push_back(async(launch::async, [shard, keyword] { return shard->searchTitles(keyword); }));
+        }
+        printMatches(pending, "matching '" + keyword + "'");
+    }
+
+    void searchByAuthor(const string& author) {
+        vector<future<vector<Book>>> pending;
+        for (const auto& branch : branches) {
+            shared_ptr<const LibrarySnapshot> shard = branch->snapshot();
+            pending.push_back(async(launch::async, [shard, author] { return shard->findByAuthor(author); }));
+        }
+        printMatches(pending, "by '" + author + "'");
+    }
+
+    void searchByPublisher(const string& publisher) {
+        vector<future<vector<Book>>> pending;
+        for (const auto& branch : branches) {
+            shared_ptr<const LibrarySnapshot> shard = branch->snapshot();
+            pending.push_back(async(launch::async, [shard, publisher] { return shard->findByPublisher(publisher); }));
+        }
+        printMatches(pending, "from publisher '" + publisher + "'");
+    }
+
+    void searchByYearRange(int fromYear, int toYear) {
+        vector<future<vector<Book>>> pending;
+        for (const auto& branch : branches) {
+            shared_ptr<const LibrarySnapshot> shard = branch->snapshot();
+            pending.push_back(async(launch::async, [shard, fromYear, toYear] { return shard->findByYearRange(fromYear, toYear); }));
+        }
+        printMatches(pending, "published " + to_string(fromYear) + "-" + to_string(toYear));
+    }
+
+    void displayBooks() {
+        for (const auto& branch : branches) {
+            if (branches.size() > 1)
+                out() << "Branch: " << branch->getBranchName() << '\n';
+            branch->displayBooks();
+        }
+    }
+
+    void displayAccounts() {
+        for (const auto& branch : branches) {
+            if (branches.size() > 1)
+                out() << "Branch: " << branch->getBranchName() << '\n';
+            branch->displayAccounts();
+        }
+    }
+
+    void saveState() {
+        for (auto& branch : branches)
+            branch->saveState();
+    }
+};
+
+// Reading resident memory from /proc; 0 where that is unavailable
+size_t residentMemoryBytes()
+{
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+        return resident * (size_t)sysconf(_SC_PAGESIZE);
+    return 0;
+}
+
+// Picks rank i (0-based) with probability proportional to 1 / (i + 1)^s
+class ZipfSampler
+{
+private:
+    vector<double> cumulative;
+
+public:
+    ZipfSampler(size_t n, double s) : cumulative(n) {
+        double total = 0;
+        for (size_t i = 0; i < n; i++) {
+            total += 1.0 / pow((double)(i + 1), s);
+            cumulative[i] = total;
+        }
+    }
+
+    size_t operator()(mt19937_64& rng) const {
+        uniform_real_distribution<double> pick(0, cumulative.back());
+        size_t rank = upper_bound(cumulative.begin(), cumulative.end(), pick(rng)) - cumulative.begin();
+        return min(rank, cumulative.size() - 1);
+    }
+};
+
+struct TraceEvent
+{
+    time_t day;
+    string op;      // LOGIN, BORROW, RETURN or PAY
+    string name;
+    int userId;
+    string title;
+};
+
+// Drives an in-memory library with a recorded or synthetic trace under a simulated
+// clock, reporting throughput, latency and memory for every simulated month
+class WorkloadHarness
+{
+private:
+    static const time_t startDay = 19723;   // 2024-01-01
+
+    size_t titleCount;
+    size_t patronCount;
+    unsigned long long seed;
+    SimulatedClock clock;
+    LibraryRouter library;
+    Library* branch;
+    FdSink discard;     // the menus' messages go to /dev/null, counting the writes they cost
+    ostream& report;
+    ofstream recordFile;
+
+    time_t periodStart;
+    vector<double> periodLatencies;     // microseconds
+    double periodBusySeconds;
+    long long totalOps;
+    double totalBusySeconds;
+    unsigned long long totalAllocations;    // made while applying events, on this thread
+
+    static string titleName(size_t i) { return "Simulated Title " + to_string(i); }
+    static string patronName(size_t j) { return "Patron" + to_string(j); }
+    static int patronId(size_t j) { return 1000 + (int)j; }
+
+    void flushPeriod(time_t endDay) {
+        if (periodLatencies.empty())
+            return;
+        sort(periodLatencies.begin(), periodLatencies.end());
+        size_t n = periodLatencies.size();
+        long long openLoans = 0;
+        for (const auto& acc : branch->getAccounts())
+            openLoans += acc.loanCount();
+        report << "Days " << periodStart - startDay << "-" << endDay - startDay
+               << ": ops=" << n
+               << " throughput=" << (long long)(n / max(periodBusySeconds, 1e-9)) << " ops/s"
+               << " p50=" << periodLatencies[n / 2] << "us"
+               << " p99=" << periodLatencies[min(n - 1, n * 99 / 100)] << "us"
+               << " max=" << periodLatencies.back() << "us"
+               << " openLoans=" << openLoans
+               << " rss=" << residentMemoryBytes() / (1024.0 * 1024.0) << "MB" << endl;
+        periodLatencies.clear();
+        periodBusySeconds = 0;
+        periodStart = endDay;
+    }
+
+public:
+    WorkloadHarness(size_t titles, size_t patrons, unsigned long long rngSeed)
+        : titleCount(titles), patronCount(patrons), seed(rngSeed), clock(startDay), branch(new Library("Simulated", "", "")),
+          discard(open("/dev/null", O_WRONLY)), report(cout), periodStart(startDay), periodBusySeconds(0),
+          totalOps(0), totalBusySeconds(0), totalAllocations(0) {
+        setOutput(&discard);
+        library.addBranch(branch);
+        Librarian admin("Simulator", 0);
+        mt19937_64 rng(seed);
+        for (size_t i = 0; i < titleCount; i++) {
+            branch->addBook(Book(titleName(i), "Author " + to_string(i % 997), "Publisher " + to_string(i % 53),
+                                 1800 + (int)(i % 220), to_string(9780000000000ULL + i)), admin);
+        }
+        for (size_t j = 0; j < patronCount; j++) {
+            shared_ptr<User> patron;
+            if (rng() % 5 == 0)
+                patron = make_shared<Faculty>(patronName(j), patronId(j));
+            else
+                patron = make_shared<Student>(patronName(j), patronId(j));
+            branch->addAccount(Account(patron), admin);
+        }
+        setClock(&clock);
+    }
+
+    ~WorkloadHarness() {
+        setClock(nullptr);
+        setOutput(nullptr);
+        close(discard.getFd());
+    }
+
+    // Every applied event is also written to path, so the run can be replayed later
+    bool recordTo(const string& path) {
+        recordFile.open(path);
+        if (!recordFile.is_open())
+            return false;
+        recordFile << "#setup\t" << titleCount << "\t" << patronCount << "\t" << seed << "\n";
+        return true;
+    }
+
+    void apply(const TraceEvent& ev) {
+        if (ev.day > clock.today()) {
+            while (ev.day - periodStart >= 30)
+                flushPeriod(periodStart + 30);
+            clock.setDay(ev.day);
+        }
+        if (recordFile.is_open())
+            recordFile << ev.day << "\t" << ev.op << "\t" << ev.name << "\t" << ev.userId << "\t" << ev.title << "\n";
+
+        unsigned long long allocationsBefore = heapCounters.allocations;
+        auto started = chrono::steady_clock::now();
+        Library* home = nullptr;
+        Account* acc = library.findAccount(ev.name, ev.userId, home);
+        if (acc) {
+            if (ev.op == "BORROW")
+                library.borrowBook(*home, *acc, ev.title, ev.day);
+            else if (ev.op == "RETURN")
+                library.returnBook(*home, *acc, ev.title, ev.day);
+            else if (ev.op == "PAY")
+                home->payFine(*acc, ev.day);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        totalAllocations += heapCounters.allocations - allocationsBefore;
+
+        periodLatencies.push_back(seconds * 1e6);
+        periodBusySeconds += seconds;
+        totalBusySeconds += seconds;
+        totalOps++;
+    }
+
+    void runSynthetic(int days, int sessionsPerDay, double zipfExponent) {
+        mt19937_64 rng(seed + 1);
+        ZipfSampler popularity(titleCount, zipfExponent);
+
+        for (int d = 0; d < days; d++) {
+            time_t day = startDay + d;
+            for (int k = 0; k < sessionsPerDay; k++) {
+                size_t j = rng() % patronCount;
+                TraceEvent ev;
+                ev.day = day;
+                ev.name = patronName(j);
+                ev.userId = patronId(j);
+                ev.op = "LOGIN";
+                apply(ev);
+
+                Library* home = nullptr;
+                Account* acc = library.findAccount(ev.name, ev.userId, home);
+                vector<string> loans = acc->getBorrowedBooks();
+                const BorrowerBase* borrower = acc->getBorrower();
+                if (borrower && borrower->computeFine(day) > 0 && rng() % 10 < 7) {
+                    ev.op = "PAY";
+                } else if (!loans.empty() && rng() % 100 < 45) {
+                    ev.op = "RETURN";
+                    ev.title = loans[rng() % loans.size()];
+                } else {
+                    ev.op = "BORROW";
+                    ev.title = titleName(popularity(rng));
+                }
+                apply(ev);
             }
-        } 
-        else 
-        {
-            cout << "Invalid role choice. Please try again." << endl;
         }
+        finish(startDay + days);
+    }
+
+    static bool readSetup(istream& in, size_t& titles, size_t& patrons, unsigned long long& rngSeed) {
+        string line, tag;
+        if (!getline(in, line))
+            return false;
+        stringstream ss(line);
+        return (ss >> tag >> titles >> patrons >> rngSeed) && tag == "#setup";
+    }
+
+    void replay(istream& in) {
+        string line;
+        time_t lastDay = startDay;
+        while (getline(in, line)) {
+            stringstream ss(line);
+            string dayStr, idStr;
+            TraceEvent ev;
+            getline(ss, dayStr, '\t');
+            getline(ss, ev.op, '\t');
+            getline(ss, ev.name, '\t');
+            getline(ss, idStr, '\t');
+            getline(ss, ev.title);
+            try {
+                ev.day = stoll(dayStr);
+                ev.userId = stoi(idStr);
+            } catch (const exception&) {
+                continue;
+            }
+            apply(ev);
+            lastDay = ev.day;
+        }
+        finish(lastDay + 1);
+    }
+
+    void finish(time_t endDay) {
+        flushPeriod(endDay);
+        report << "Total: " << totalOps << " ops over " << endDay - startDay << " simulated days, "
+               << (long long)(totalOps / max(totalBusySeconds, 1e-9)) << " ops/s, "
+               << "outputWrites=" << discard.getWriteCalls() << ", "
+               << "allocations/op=" << (double)totalAllocations / max(totalOps, 1LL) << ", "
+               << "rss=" << residentMemoryBytes() / (1024.0 * 1024.0) << "MB" << endl;
+        const BloomFilter& filter = branch->getAccountFilter();
+        report << "Account filter: " << filter.getKeyCount() << " keys in " << filter.memoryBytes() << " bytes, "
+               << "estimated false positives " << filter.estimatedFalsePositiveRate() * 100 << "%, "
+               << filter.getQueries() << " lookups, " << filter.getRejected() << " rejected, "
+               << filter.getFalsePositives() << " false positives" << endl;
+        library.memoryReport().print(report);
+        report.flush();
+    }
+};
+
+// Command line entry for the workload harness:
+//   --simulate [--days N] [--sessions-per-day N] [--titles N] [--patrons N] [--zipf S] [--seed N] [--record FILE]
+//   --replay FILE
+int runWorkload(int argc, char* argv[])
+{
+    string mode = argv[1];
+    int days = 90, sessionsPerDay = 500;
+    size_t titles = 10000, patrons = 5000;
+    double zipf = 1.0;
+    unsigned long long seed = 42;
+    string recordPath, replayPath;
+
+    int firstOption = 2;
+    if (mode == "--replay") {
+        if (argc < 3) {
+            cerr << "Usage: --replay TRACE" << endl;
+            return 1;
+        }
+        replayPath = argv[2];
+        firstOption = 3;
+    }
+
+    for (int i = firstOption; i < argc; i++) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << flag << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (flag == "--days") days = stoi(value);
+        else if (flag == "--sessions-per-day") sessionsPerDay = stoi(value);
+        else if (flag == "--titles") titles = stoul(value);
+        else if (flag == "--patrons") patrons = stoul(value);
+        else if (flag == "--zipf") zipf = stod(value);
+        else if (flag == "--seed") seed = stoull(value);
+        else if (flag == "--record") recordPath = value;
+        else {
+            cerr << "Unknown option " << flag << endl;
+            return 1;
+        }
+    }
+    if (mode == "--replay") {
+        ifstream trace(replayPath);
+        if (!trace.is_open() || !WorkloadHarness::readSetup(trace, titles, patrons, seed)) {
+            cerr << "Could not read a trace with a #setup header from '" << replayPath << "'" << endl;
+            return 1;
+        }
+        WorkloadHarness harness(titles, patrons, seed);
+        harness.replay(trace);
+        return 0;
+    }
+
+    if (titles == 0 || patrons == 0) {
+        cerr << "Need at least one title and one patron" << endl;
+        return 1;
+    }
+    WorkloadHarness harness(titles, patrons, seed);
+    if (!recordPath.empty() && !harness.recordTo(recordPath)) {
+        cerr << "Could not open " << recordPath << " for recording" << endl;
+        return 1;
+    }
+    harness.runSynthetic(days, sessionsPerDay, zipf);
+    return 0;
+}
+
+// One user's conversation with the library, driven a line at a time. feed() handles one
+// answer and prints the next prompt without waiting for input, so a single thread can
+// interleave any number of sessions. The account is looked up again for every command,
+// since other sessions may add or remove accounts in between
+class Session
+{
+private:
+    enum State : unsigned char
+    {
+        RoleMenu, AskName, AskId,
+        StudentMenu, FacultyMenu, LibrarianMenu,
+        BorrowTitle, ReturnTitle,
+        NewBookTitle, NewBookAuthor, NewBookPublisher, NewBookYear, NewBookIsbn,
+        RemoveBookTitle, NewUserName, NewUserId, NewUserType, RemoveUserName,
+        ReportMenu, ReportMonth, ReportDays,
+        SearchMenu, SearchTitle, SearchAuthor, SearchPublisher, SearchYears,
+        Closed
+    };
+
+    static const long long maxReportDays = 366;   // one line per day, so a report stays short
+
+    LibraryRouter& library;
+    CirculationLog& circulation;
+    State state;
+    int role;                   // 1 student, 2 faculty, 3 librarian, as on the role menu
+    int userId;
+    string userName;
+    Library* homeBranch;
+    vector<string> answers;     // earlier answers of a multi-step prompt
+    vector<long long> numbers;  // numeric answers read so far
+
+    // Numbers may be split over lines or follow blank lines, as with cin >>;
+    // true once count of them have arrived. Anything unreadable counts as 0
+    bool gather(const string& line, size_t count) {
+        istringstream tokens(line);
+        string token;
+        while (tokens >> token) {
+            char* end = nullptr;
+            long long value = strtoll(token.c_str(), &end, 10);
+            numbers.push_back(*end == '\0' ? value : 0);
+        }
+        return numbers.size() >= count;
+    }
+
+    void prompt(State next, const char* text) {
+        out() << text;
+        state = next;
+    }
+
+    // "harry?" at a title prompt lists the titles starting with "harry" and asks again,
+    // rather than trying it as a title. Titles that really end in '?' go through as usual
+    bool offerCompletions(const string& line, const char* text) {
+        if (line.empty() || line.back() != '?')
+            return false;
+        string prefix = line.substr(0, line.size() - 1);
+        if (state == ReturnTitle) {
+            Account* acc = sessionAccount();
+            if (!acc)
+                return true;
+            string wanted = TitleIndex::normalize(prefix);
+            vector<string> matches;
+            for (const auto& title : acc->getBorrowedBooks()) {
+                string key = TitleIndex::normalize(title);
+                if (key == wanted)
+                    return false;
+                if (key.compare(0, wanted.size(), wanted) == 0 && find(matches.begin(), matches.end(), title) == matches.end())
+                    matches.push_back(title);
+            }
+            if (matches.empty())
+                out() << "None of your books start with '" << prefix << "'.\n";
+            for (size_t i = 0; i < matches.size(); i++)
+                out() << i + 1 << ". " << matches[i] << '\n';
+        } else {
+            if (library.isKnownTitle(line))
+                return false;
+            vector<TitleCompleter::Completion> matches = library.completeTitle(prefix, TitleCompleter::maxCompletions);
+            if (matches.empty())
+                out() << "No titles start with '" << prefix << "'.\n";
+            for (size_t i = 0; i < matches.size(); i++) {
+                out() << i + 1 << ". " << matches[i].title;
+                if (matches[i].available > 0)
+                    out() << " (" << matches[i].available << " available)\n";
+                else
+                    out() << " (all copies on loan)\n";
+            }
+        }
+        prompt(state, text);
+        return true;
+    }
+
+    void showRoleMenu() {
+        out() << "\n------------------------------------------\n";
+        out() << "Welcome to the the IITK Library Management System!\n";
+        out() << "------------------------------------------\n";
+        out() << "Please select your role:\n";
+        out() << "1. Student\n";
+        out() << "2. Faculty\n";
+        out() << "3. Librarian\n";
+        out() << "4. Exit\n";
+        answers.clear();
+        numbers.clear();
+        prompt(RoleMenu, "Enter your choice: ");
+    }
+
+    void showUserMenu() {
+        static const char* const studentItems[] = {"Borrow Book", "Return Book", "Pay Fine", "Display Account",
+                                                   "Display Available Books", "Search Catalog", "Exit"};
+        static const char* const facultyItems[] = {"Borrow Book", "Return Book", "Display Account",
+                                                   "Display Available Books", "Search Catalog", "Exit"};
+        static const char* const librarianItems[] = {"Add Book", "Remove Book", "Add Account", "Remove Account",
+                                                     "Display Books", "Display Accounts", "Circulation Reports",
+                                                     "Search Catalog", "Memory Diagnostics", "Exit"};
+        const char* const* items = role == 1 ? studentItems : role == 2 ? facultyItems : librarianItems;
+        int itemCount = role == 1 ? 7 : role == 2 ? 6 : 10;
+
+        out() << "\n------------------------------------------\n";
+        out() << (role == 1 ? "Student" : role == 2 ? "Faculty" : "Librarian") << " Menu:\n";
+        out() << "------------------------------------------\n";
+        for (int i = 0; i < itemCount; i++)
+            out() << i + 1 << ". " << items[i] << '\n';
+        answers.clear();
+        numbers.clear();
+        prompt(role == 1 ? StudentMenu : role == 2 ? FacultyMenu : LibrarianMenu, "Enter your choice: ");
+    }
+
+    // Null, after going back to the role menu, when the account was removed meanwhile
+    // Also null when the account was removed and added back under another role
+    Account* sessionAccount() {
+        Account* acc = library.findAccount(userName, userId, homeBranch);
+        if (!acc) {
+            out() << "Your account is no longer available.\n";
+            showRoleMenu();
+        } else if (acc->getUser()->getRole() != roleName()) {
+            out() << "Your account is no longer " << roleDescription() << ".\n";
+            showRoleMenu();
+            return nullptr;
+        }
+        return acc;
+    }
+
+    // The role menu lists the borrowing roles in borrowerRoles() order, then Librarian
+    const char* roleName() const {
+        return role <= (int)borrowerRoles().size() ? borrowerRoles()[role - 1].name : "Librarian";
+    }
+
+    const char* roleDescription() const {
+        return role <= (int)borrowerRoles().size() ? borrowerRoles()[role - 1].described : "a librarian";
+    }
+
+    void login() {
+        if (role < 1 || role > 3) {
+            out() << "Invalid role choice. Please try again.\n";
+            showRoleMenu();
+            return;
+        }
+
+        Account* account = library.findAccount(userName, userId, homeBranch);
+        if (!account) {
+            out() << "No account found with name '" << userName << "' and ID " << userId << ".\n";
+            if (role != 3) {
+                out() << "Please contact a librarian to create an account.\n";
+                showRoleMenu();
+                return;
+            }
+            if (userName != "Admin" || userId != 1) {
+                out() << "Please use the default librarian account (Admin, ID: 1) to create new accounts.\n";
+                showRoleMenu();
+                return;
+            }
+            out() << "Creating default librarian account...\n";
+            homeBranch = &library.getBranch(0);
+            homeBranch->addDefaultLibrarian();
+        } else if (account->getUser()->getRole() != roleName()) {
+            out() << "Error: User '" << userName << "' exists but is not " << roleDescription() << ".\n";
+            out() << "This user has role: " << account->getUser()->getRole() << '\n';
+            showRoleMenu();
+            return;
+        }
+        showUserMenu();
+    }
+
+    void showSearchMenu() {
+        out() << "Search by:\n";
+        out() << "1. Title\n";
+        out() << "2. Author\n";
+        out() << "3. Publisher\n";
+        out() << "4. Year Range\n";
+        prompt(SearchMenu, "Enter choice: ");
+    }
+
+    void borrowerCommand(int choice) {
+        // Faculty have no Pay Fine entry, so their later options sit one lower
+        if (role == 2 && choice >= 3)
+            choice++;
+        if (choice == 7) {
+            showRoleMenu();
+            return;
+        }
+        if (choice == 1) {
+            prompt(BorrowTitle, "Enter the book title: ");
+            return;
+        }
+        if (choice == 2) {
+            prompt(ReturnTitle, "Enter the book title: ");
+            return;
+        }
+        if (choice == 6) {
+            showSearchMenu();
+            return;
+        }
+
+        if (choice == 3 || choice == 4) {
+            Account* acc = sessionAccount();
+            if (!acc)
+                return;
+            if (choice == 3)
+                homeBranch->payFine(*acc, getCurrentDate());
+            else
+                acc->getUser()->display();
+        } else if (choice == 5) {
+            library.displayBooks();
+        } else {
+            out() << "Invalid choice. Please try again.\n";
+        }
+        showUserMenu();
+    }
+
+    void librarianCommand(int choice) {
+        switch (choice) {
+        case 1: prompt(NewBookTitle, "Enter book title: "); return;
+        case 2: prompt(RemoveBookTitle, "Enter the book title to remove: "); return;
+        case 3: prompt(NewUserName, "Enter new user name: "); return;
+        case 4: prompt(RemoveUserName, "Enter the user name to remove: "); return;
+        case 5: library.displayBooks(); break;
+        case 6: library.displayAccounts(); break;
+        case 7:
+            out() << "Circulation Reports (" << circulation.getEventCount() << " events recorded):\n";
+            out() << "1. Most Borrowed Titles for a Month\n";
+            out() << "2. Average Loan Duration by Role\n";
+            out() << "3. Overdue Rate by Author\n";
+            out() << "4. Active Borrowers per Day\n";
+            prompt(ReportMenu, "Enter choice: ");
+            return;
+        case 8: showSearchMenu(); return;
+        case 9: library.memoryReport().print(out()); break;
+        case 10: showRoleMenu(); return;
+        default: out() << "Invalid choice. Please try again.\n"; break;
+        }
+        showUserMenu();
+    }
+
+    void reportCommand(int choice) {
+        if (choice == 1) {
+            prompt(ReportMonth, "Enter year and month (e.g. 2024 7): ");
+            return;
+        }
+        if (choice == 4) {
+            prompt(ReportDays, "Enter number of days to show (ending today): ");
+            return;
+        }
+        if (choice == 2)
+            circulation.displayLoanDurationByRole();
+        else if (choice == 3)
+            circulation.displayOverdueRateByAuthor(10);
+        else
+            out() << "Invalid report choice.\n";
+        showUserMenu();
+    }
+
+    void searchCommand(int choice) {
+        if (choice == 1)
+            prompt(SearchTitle, "Enter part of the title: ");
+        else if (choice == 2)
+            prompt(SearchAuthor, "Enter author: ");
+        else if (choice == 3)
+            prompt(SearchPublisher, "Enter publisher: ");
+        else if (choice == 4)
+            prompt(SearchYears, "Enter first and last year (e.g. 1800 1900): ");
+        else {
+            out() << "Invalid search choice.\n";
+            showUserMenu();
+        }
+    }
+
+    // Running a librarian action on the branch of a librarian account that still exists
+    template <typename Action>
+    void asLibrarian(Action action) {
+        Account* acc = sessionAccount();
+        if (!acc)
+            return;
+        const Librarian* librarian = dynamic_cast<const Librarian*>(acc->getUser().get());
+        if (!librarian) {
+            out() << "Your account is no longer a librarian.\n";
+            showRoleMenu();
+            return;
+        }
+        action(*librarian);
+        showUserMenu();
+    }
+
+public:
+    Session(LibraryRouter& lib, CirculationLog& log)
+        : library(lib), circulation(log), state(RoleMenu), role(0), userId(0), homeBranch(nullptr) {}
+
+    void start() { showRoleMenu(); }
+
+    bool isClosed() const { return state == Closed; }
+
+    void feed(string line) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        switch (state) {
+        case RoleMenu:
+            if (!gather(line, 1))
+                return;
+            role = (int)numbers[0];
+            numbers.clear();
+            if (role == 4) {
+                // Flushing pending changes before leaving
+                library.saveState();
+                out() << "Thank you for using the Library Management System. Goodbye!\n";
+                state = Closed;
+                return;
+            }
+            prompt(AskName, "Enter your name: ");
+            break;
+        case AskName:
+            userName = line;
+            prompt(AskId, "Enter your ID: ");
+            break;
+        case AskId:
+            if (!gather(line, 1))
+                return;
+            userId = (int)numbers[0];
+            numbers.clear();
+            login();
+            break;
+
+        case StudentMenu:
+        case FacultyMenu:
+        case LibrarianMenu:
+        case ReportMenu:
+        case SearchMenu:
+            if (gather(line, 1)) {
+                int choice = (int)numbers[0];
+                numbers.clear();
+                if (state == LibrarianMenu)
+                    librarianCommand(choice);
+                else if (state == ReportMenu)
+                    reportCommand(choice);
+                else if (state == SearchMenu)
+                    searchCommand(choice);
+                else
+                    borrowerCommand(choice);
+            }
+            break;
+
+        case BorrowTitle:
+        case ReturnTitle:
+            if (offerCompletions(line, "Enter the book title: "))
+                break;
+            if (Account* acc = sessionAccount()) {
+                if (state == BorrowTitle)
+                    library.borrowBook(*homeBranch, *acc, line, getCurrentDate());
+                else
+                    library.returnBook(*homeBranch, *acc, line, getCurrentDate());
+                showUserMenu();
+            }
+            break;
+
+        case NewBookTitle:
+            answers.push_back(line);
+            prompt(NewBookAuthor, "Enter author: ");
+            break;
+        case NewBookAuthor:
+            answers.push_back(line);
+            prompt(NewBookPublisher, "Enter publisher: ");
+            break;
+        case NewBookPublisher:
+            answers.push_back(line);
+            prompt(NewBookYear, "Enter year: ");
+            break;
+        case NewBookYear:
+            if (gather(line, 1))
+                prompt(NewBookIsbn, "Enter ISBN: ");
+            break;
+        case NewBookIsbn:
+            asLibrarian([&](const Librarian& librarian) {
+                Book newBook(answers[0], answers[1], answers[2], (int)numbers[0], line);
+                homeBranch->addBook(newBook, librarian);
+            });
+            break;
+        case RemoveBookTitle:
+            if (offerCompletions(line, "Enter the book title to remove: "))
+                break;
+            asLibrarian([&](const Librarian& librarian) { homeBranch->removeBook(line, librarian); });
+            break;
+
+        case NewUserName:
+            answers.push_back(line);
+            prompt(NewUserId, "Enter new user ID: ");
+            break;
+        case NewUserId:
+            if (!gather(line, 1))
+                return;
+            out() << "Select user type:\n";
+            out() << "1. Student\n";
+            out() << "2. Faculty\n";
+            out() << "3. Librarian\n";
+            prompt(NewUserType, "Enter choice: ");
+            break;
+        case NewUserType:
+            if (!gather(line, 2))
+                return;
+            asLibrarian([&](const Librarian& librarian) {
+                shared_ptr<User> newUser;
+                int newUserId = (int)numbers[0];
+                if (numbers[1] == 1)
+                    newUser = make_shared<Student>(answers[0], newUserId);
+                else if (numbers[1] == 2)
+                    newUser = make_shared<Faculty>(answers[0], newUserId);
+                else if (numbers[1] == 3)
+                    newUser = make_shared<Librarian>(answers[0], newUserId);
+
+                if (newUser)
+                    homeBranch->addAccount(Account(newUser), librarian);
+                else
+                    out() << "Invalid user type. Account creation failed.\n";
+            });
+            break;
+        case RemoveUserName:
+            asLibrarian([&](const Librarian& librarian) { homeBranch->removeAccount(line, librarian); });
+            break;
+
+        case ReportMonth:
+            if (gather(line, 2)) {
+                circulation.displayTopTitles((int)numbers[0], (int)numbers[1], 10);
+                showUserMenu();
+            }
+            break;
+        case ReportDays:
+            if (gather(line, 1)) {
+                time_t today = getCurrentDate();
+                long long days = max(numbers[0], 1LL);
+                if (days > maxReportDays) {
+                    out() << "Showing the last " << maxReportDays << " days.\n";
+                    days = maxReportDays;
+                }
+                circulation.displayActiveBorrowers(today - (time_t)days + 1, today);
+                showUserMenu();
+            }
+            break;
+
+        case SearchTitle:
+            library.searchTitles(line);
+            showUserMenu();
+            break;
+        case SearchAuthor:
+            library.searchByAuthor(line);
+            showUserMenu();
+            break;
+        case SearchPublisher:
+            library.searchByPublisher(line);
+            showUserMenu();
+            break;
+        case SearchYears:
+            if (gather(line, 2)) {
+                library.searchByYearRange((int)numbers[0], (int)numbers[1]);
+                showUserMenu();
+            }
+            break;
+
+        case Closed:
+            break;
+        }
+    }
+};
+
+const long long Session::maxReportDays;
+
+// Serves sessions from one thread. The console is one channel and, when listening, every
+// connection is another. poll() reports which channels have input; each complete line goes
+// to that channel's session, and what the session printed is sent back afterwards.
+// A connection that sends an over-long line or stops reading its output is closed, so
+// one client cannot take an unbounded share of memory.
+class SessionMultiplexer
+{
+private:
+    static const size_t maxLineBytes = 4096;
+    static const size_t maxUnsentBytes = 1 << 20;
+
+    struct Channel
+    {
+        int inFd;
+        int outFd;
+        Session session;
+        string partialLine;
+        string unsent;      // output the connection could not take yet
+        bool finished;
+
+        Channel(int in, int output, LibraryRouter& library, CirculationLog& circulation)
+            : inFd(in), outFd(output), session(library, circulation), finished(false) {}
+    };
+
+    LibraryRouter& library;
+    CirculationLog& circulation;
+    vector<unique_ptr<Channel>> channels;   // the console first
+    int listenFd;
+    StringSink capture;
+
+    void send(Channel& ch) {
+        while (!ch.unsent.empty()) {
+            ssize_t written = ::write(ch.outFd, ch.unsent.data(), ch.unsent.size());
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    ch.finished = true;
+                return;
+            }
+            ch.unsent.erase(0, written);
+        }
+        string().swap(ch.unsent);   // idle sessions keep no buffers
+    }
+
+    // Running one step of a session with its output captured for the channel
+    template <typename Step>
+    void step(Channel& ch, Step fn) {
+        setOutput(&capture);
+        fn();
+        setOutput(nullptr);
+        ch.unsent += capture.take();
+        send(ch);
+        if (ch.session.isClosed())
+            ch.finished = true;
+        if (ch.inFd != STDIN_FILENO && ch.unsent.size() > maxUnsentBytes)
+            ch.finished = true;   // the client is not reading
+    }
+
+    void receive(Channel& ch) {
+        char buf[4096];
+        ssize_t n = ::read(ch.inFd, buf, sizeof buf);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                ch.finished = true;
+            return;
+        }
+        if (n == 0) {
+            // A last line without a newline still counts
+            if (!ch.partialLine.empty())
+                step(ch, [&] { ch.session.feed(ch.partialLine); });
+            ch.finished = true;
+            return;
+        }
+
+        ch.partialLine.append(buf, n);
+        size_t start = 0, newline;
+        while (!ch.finished && (newline = ch.partialLine.find('\n', start)) != string::npos) {
+            string line = ch.partialLine.substr(start, newline - start);
+            start = newline + 1;
+            step(ch, [&] { ch.session.feed(line); });
+        }
+        ch.partialLine.erase(0, start);
+        if (ch.partialLine.empty())
+            string().swap(ch.partialLine);
+        else if (ch.inFd != STDIN_FILENO && ch.partialLine.size() > maxLineBytes)
+            ch.finished = true;
+    }
+
+    void acceptConnections() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                return;
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            channels.emplace_back(new Channel(fd, fd, library, circulation));
+            Channel& ch = *channels.back();
+            step(ch, [&] { ch.session.start(); });
+        }
+    }
+
+    void closeChannel(Channel& ch) {
+        if (ch.inFd != STDIN_FILENO)
+            close(ch.inFd);
+    }
+
+public:
+    SessionMultiplexer(LibraryRouter& lib, CirculationLog& log) : library(lib), circulation(log), listenFd(-1) {
+        channels.emplace_back(new Channel(STDIN_FILENO, STDOUT_FILENO, library, circulation));
+    }
+
+    ~SessionMultiplexer() {
+        for (auto& ch : channels)
+            closeChannel(*ch);
+        if (listenFd >= 0)
+            close(listenFd);
+    }
+
+    // Taking connections on a local TCP port, one session each
+    bool listenOn(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return false;
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr*)&addr, sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0) {
+            close(fd);
+            return false;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        signal(SIGPIPE, SIG_IGN);   // a vanished connection shows up as a failed write instead
+        listenFd = fd;
+        return true;
+    }
+
+    // Serving until the console session ends
+    void run() {
+        Channel& console = *channels.front();
+        step(console, [&] { console.session.start(); });
+
+        vector<pollfd> fds;
+        while (!console.finished) {
+            fds.clear();
+            for (const auto& ch : channels) {
+                pollfd entry = {ch->inFd, (short)(ch->unsent.empty() ? POLLIN : POLLIN | POLLOUT), 0};
+                fds.push_back(entry);
+            }
+            if (listenFd >= 0) {
+                pollfd entry = {listenFd, POLLIN, 0};
+                fds.push_back(entry);
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                cerr << "Error waiting for input: " << strerror(errno) << endl;
+                return;
+            }
+
+            size_t channelCount = channels.size();
+            for (size_t i = 0; i < channelCount; i++) {
+                Channel& ch = *channels[i];
+                if (fds[i].revents & POLLOUT)
+                    send(ch);
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive(ch);
+            }
+            if (listenFd >= 0 && (fds.back().revents & POLLIN))
+                acceptConnections();
+
+            // Dropping finished connections; the console stays until the loop ends
+            auto firstDone = remove_if(channels.begin() + 1, channels.end(), [&](const unique_ptr<Channel>& ch) {
+                if (ch->finished)
+                    closeChannel(*ch);
+                return ch->finished;
+            });
+            channels.erase(firstDone, channels.end());
+        }
+    }
+};
+
+const size_t SessionMultiplexer::maxLineBytes;
+const size_t SessionMultiplexer::maxUnsentBytes;
+
+// Command line entry for downstream consumers: prints every change after SEQ from
+// changes.log, and with --follow keeps printing new ones as they arrive
+int exportChanges(int argc, char* argv[])
+{
+    bool follow = argc == 4 && string(argv[3]) == "--follow";
+    if (argc != 3 && !follow) {
+        cerr << "Usage: " << argv[0] << " --changes-since SEQ [--follow]" << endl;
+        return 1;
+    }
+    long long sequence = atoll(argv[2]);
+    while (true) {
+        sequence = ChangeStream::copySince("changes.log", sequence, out());
+        out().flush();
+        if (!follow)
+            return 0;
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+}
+
+int main(int argc, char* argv[]) 
+{
+    // Unsynchronized, buffered console I/O; pending output is flushed before each read and each error
+    ios::sync_with_stdio(false);
+    cin.tie(&out());
+    cerr.tie(&out());
+
+    int listenPort = 0;
+    if (argc > 1) {
+        string mode = argv[1];
+        if (mode == "--simulate" || mode == "--replay")
+            return runWorkload(argc, argv);
+        if (mode == "--changes-since")
+            return exportChanges(argc, argv);
+        if (mode == "--listen" && argc == 3) {
+            listenPort = atoi(argv[2]);
+        } else {
+            cerr << "Usage: " << argv[0]
+                 << " [--simulate [options] | --replay TRACE | --listen PORT | --changes-since SEQ [--follow]]" << endl;
+            return 1;
+        }
+    }
+
+    // The logs outlive the branches, whose writers publish to them until they stop
+    CirculationLog circulation("circulation.log");
+    ChangeStream changes("changes.log");
+    LibraryRouter library;
+
+    // Loading every branch's state from its files (if they exist). The logs are attached
+    // first so that a default Admin account created here is recorded too
+    library.attachCirculationLog(&circulation);
+    library.attachChangeStream(&changes);
+    library.loadBranches("branches.txt");
+
+    // The console session, plus one per connection when listening; all on this thread
+    SessionMultiplexer sessions(library, circulation);
+    if (listenPort > 0 && !sessions.listenOn(listenPort)) {
+        cerr << "Could not listen on port " << listenPort << endl;
+        return 1;
     }
+    sessions.run();
 
+    out().flush();
     return 0;
 }